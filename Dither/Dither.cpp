@@ -30,7 +30,432 @@ SOFTWARE.
 ********************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "Dither.h"
+#include "DitherSIMD.h"
+#include "DitherMatrix.h"
+
+#if DITHER_THREADS
+	#include <thread>
+	#include <atomic>
+	#include <mutex>
+#endif
+#if DITHER_STATS  &&  !defined(ARDUINO)
+	#include <chrono>
+#endif
+
+
+// Packed output: rows are packed as soon as an algorithm has completed them, while they are still in cache (see setOutput).
+// Gray levels are recovered as value >> (8 - bits): for every output of the quantizer (inverted or not) this is exactly its level.
+struct _PackedSink{
+	uint8_t *buffer;
+	uint8_t format;
+	uint32_t stride;
+	uint8_t quantization_bits;		// number of planes, for DITHER_OUT_BITPLANES
+	
+	// Packs the bit "plane" of each pixel level (bits per pixel = 1), MSB first
+	static void packBits(const uint8_t *src, uint8_t *dst, uint32_t width, uint8_t shift){
+		uint32_t x = 0;
+		for(; x + 8 <= width; x += 8, src += 8){
+			*dst++ = (((src[0] >> shift) & 1) << 7) | (((src[1] >> shift) & 1) << 6) | (((src[2] >> shift) & 1) << 5) | (((src[3] >> shift) & 1) << 4) |
+							 (((src[4] >> shift) & 1) << 3) | (((src[5] >> shift) & 1) << 2) | (((src[6] >> shift) & 1) << 1) | ((src[7] >> shift) & 1);
+		}
+		if(x < width){
+			uint8_t b = 0;
+			for(uint8_t k = 7; x < width; x++, k--)  b |= ((*src++ >> shift) & 1) << k;
+			*dst = b;
+		}
+	}
+	
+	// Packs "bits" (2 or 4) bits per pixel, leftmost pixel in the MSBs
+	static void packLevels(const uint8_t *src, uint8_t *dst, uint32_t width, uint8_t bits){
+		const uint8_t per_byte = 8 / bits, shift = 8 - bits;
+		for(uint32_t x = 0; x < width; dst++){
+			uint8_t b = 0;
+			for(uint8_t k = 0; k < per_byte; k++, x++){
+				b <<= bits;
+				if(x < width)  b |= *src++ >> shift;
+			}
+			*dst = b;
+		}
+	}
+	
+	// Row-major formats (all but DITHER_OUT_SSD1306 and DITHER_OUT_BITPLANES)
+	static void packRow(const uint8_t *src, uint8_t *dst, uint32_t width, uint8_t format){
+		if(format == DITHER_OUT_1BPP){		// pixel bit = value >> 7, as colorGray256ToBool()
+			packBits(src, dst, width, 7);
+		}
+		else if(format == DITHER_OUT_PBM){		// the other way round, padding bits left to 0
+			packBits(src, dst, width, 7);
+			size_t bytes = ((size_t)width + 7) / 8;
+			for(size_t b = 0; b < bytes; b++)  dst[b] = ~dst[b];
+			if(width & 0x07)  dst[bytes - 1] &= 0xFF << (8 - (width & 0x07));
+		}
+		else{
+			packLevels(src, dst, width, (format == DITHER_OUT_2BPP)?  2 : 4);
+		}
+	}
+	
+	void row(const uint8_t *img, uint16_t width, uint16_t height, uint16_t r, uint32_t img_stride) const{
+		const uint8_t *src = img + (uint32_t)r * img_stride;
+		
+		if(format == DITHER_OUT_1BPP  ||  format == DITHER_OUT_PBM  ||  format == DITHER_OUT_2BPP  ||  format == DITHER_OUT_4BPP){
+			packRow(src, buffer + (uint32_t)r * stride, width, format);
+		}
+		else if(format == DITHER_OUT_BITPLANES){
+			const uint32_t plane_size = stride * height;
+			for(uint8_t p = 0; p < quantization_bits; p++){
+				packBits(src, buffer + p * plane_size + (uint32_t)r * stride, width, 8 - quantization_bits + p);
+			}
+		}
+		else if(format == DITHER_OUT_SSD1306){
+			// A page (8 rows) is written at once when its last row is done; rows of a page are always completed in order, also by the wavefront workers.
+			if((r & 0x07) != 0x07  &&  r != height - 1)  return;
+			uint16_t first = r & ~0x07;
+			uint8_t rows = r - first + 1;
+			uint8_t *dst = buffer + (uint32_t)(first >> 3) * stride;
+			for(uint16_t x = 0; x < width; x++){
+				const uint8_t *src = img + (uint32_t)first * img_stride + x;
+				uint8_t b = 0;
+				for(uint8_t k = 0; k < rows; k++, src += img_stride)  b |= (*src >> 7) << k;
+				dst[x] = b;
+			}
+		}
+	}
+};
+
+// Scratch of the resampler (see setSourceSize): one per thread, since rows can be decoded by several workers at once. It only grows,
+// and is freed when its thread ends (or, for the calling thread, by setSource(NULL)).
+struct _SourceScratch{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	
+	~_SourceScratch(){  free(buf);  }
+	uint8_t *get(size_t n){
+		if(n > size){
+			uint8_t *p = (uint8_t *)realloc(buf, n);
+			if(p == NULL)  return NULL;
+			buf = p;
+			size = n;
+		}
+		return buf;
+	}
+	void release(){
+		free(buf);
+		buf = NULL;
+		size = 0;
+	}
+};
+
+static _SourceScratch &_sourceScratch(){
+	#if DITHER_THREADS
+	static thread_local _SourceScratch scratch;
+	#else
+	static _SourceScratch scratch;
+	#endif
+	return scratch;
+}
+
+// Source of the pixels, when it is not the image buffer itself (see setSource): each row is decoded to 8 bit luma right before being dithered,
+// while the rows around it are still in cache, so no gray copy of the whole image is ever made. With a source size (see setSourceSize),
+// each output row is resampled from the source rows it covers instead, in the same pass.
+struct _DitherSource{
+	const uint8_t *pixels;
+	uint8_t format;
+	uint32_t stride;					// bytes per row; 0: rows are contiguous
+	_DitherLuma luma;
+	uint8_t gray332[256];			// luma of each DITHER_RGB332 color
+	uint16_t width, height;		// size of the source; 0: the same as the image
+	uint8_t resample;
+	
+	// Luma of the n pixels of source row y starting at column x, into dst; w: width of the source
+	void decode(uint32_t y, uint32_t x, uint32_t n, uint8_t *dst, uint32_t w) const{
+		uint32_t row_bytes = stride;
+		if(row_bytes == 0){
+			switch(format){
+				case DITHER_RGB888:  row_bytes = 3 * w;  break;
+				case DITHER_RGB565:  row_bytes = 2 * w;  break;
+				case DITHER_MONO1:  row_bytes = (w + 7) / 8;  break;
+				default:  row_bytes = w;  break;		// DITHER_RGB332, DITHER_GRAY8
+			}
+		}
+		const uint8_t *src = pixels + y * row_bytes;
+		switch(format){
+			case DITHER_RGB888:  _ditherRowOps().luma888(src + 3 * x, dst, n, luma);  break;
+			case DITHER_RGB565:  _ditherRowOps().luma565(src + 2 * x, dst, n, luma);  break;
+			case DITHER_RGB332:
+				src += x;
+				for(uint32_t i = 0; i < n; i++)  dst[i] = gray332[src[i]];
+				break;
+			case DITHER_GRAY8:  memcpy(dst, src + x, n);  break;
+			case DITHER_MONO1:{
+				uint32_t i = 0;
+				src += x / 8;
+				for(uint8_t k = x % 8; i < n  &&  k > 0  &&  k < 8; i++, k++)  dst[i] = ((*src << k) & 0x80)?  0xFF : 0x00;		// leading partial byte
+				if(x % 8)  src++;
+				for(; i + 8 <= n; i += 8, src++){
+					const uint8_t b = *src;
+					for(uint8_t k = 0; k < 8; k++)  dst[i + k] = ((b << k) & 0x80)?  0xFF : 0x00;
+				}
+				for(uint8_t k = 0; i < n; i++, k++)  dst[i] = ((*src << k) & 0x80)?  0xFF : 0x00;
+				break;
+			}
+		}
+	}
+	
+	// Output row r of an out_w x out_h image, into dst
+	void row(uint32_t r, uint8_t *dst, uint16_t out_w, uint16_t out_h) const{
+		if(width == 0){
+			decode(r, 0, out_w, dst, out_w);
+			return;
+		}
+		if(resample == DITHER_RESAMPLE_AREA)  rowArea(r, dst, out_w, out_h);
+		else  rowBilinear(r, dst, out_w, out_h);
+	}
+	
+	/*
+		Area average: output pixel (x, y) is the mean of the source pixels [x * W / w, (x + 1) * W / w) x [y * H / h, (y + 1) * H / h),
+		at least one of them (when upscaling, this is the nearest one). The source rows of the box are decoded one at a time and summed
+		column by column, then each run of columns is summed; box edges are stepped with no division.
+	*/
+	void rowArea(uint32_t r, uint8_t *dst, uint16_t out_w, uint16_t out_h) const{
+		uint32_t y0 = r * height / out_h, y1 = (r + 1) * height / out_h;
+		if(y1 <= y0)  y1 = y0 + 1;
+		
+		const size_t aligned = (width + 3) & ~3;
+		uint8_t *line = _sourceScratch().get(aligned + 4 * (size_t)width);
+		if(line == NULL){
+			rowNearest(r, dst, out_w, out_h);
+			return;
+		}
+		uint32_t *sums = (uint32_t *)(line + aligned);
+		memset(sums, 0, 4 * (size_t)width);
+		for(uint32_t y = y0; y < y1; y++){
+			decode(y, 0, width, line, width);
+			for(uint16_t x = 0; x < width; x++)  sums[x] += line[x];
+		}
+		
+		const uint32_t rows = y1 - y0;
+		const uint16_t step = width / out_w, step_rem = width % out_w;
+		uint32_t x0 = 0, rem = 0;
+		for(uint16_t x = 0; x < out_w; x++){
+			uint32_t x1 = x0 + step;
+			rem += step_rem;
+			if(rem >= out_w){
+				rem -= out_w;
+				x1++;
+			}
+			const uint32_t cols = (x1 > x0)?  x1 - x0 : 1;
+			uint32_t sum = 0;
+			for(uint32_t c = 0; c < cols; c++)  sum += sums[x0 + c];
+			const uint32_t count = rows * cols;
+			dst[x] = (sum + count / 2) / count;
+			x0 = x1;
+		}
+	}
+	
+	/*
+		Bilinear: output pixel centers are mapped onto the source ((x + 0.5) * W / w - 0.5, clamped to the edges), in 16.16 fixed point,
+		and the 4 source pixels around each one are weighted by 8 bit fractions. Meant for upscaling (downscaling skips source pixels).
+	*/
+	void rowBilinear(uint32_t r, uint8_t *dst, uint16_t out_w, uint16_t out_h) const{
+		uint8_t *line = _sourceScratch().get(2 * (size_t)width);
+		if(line == NULL){
+			rowNearest(r, dst, out_w, out_h);
+			return;
+		}
+		uint32_t y0, fy;
+		_bilinearPos(r, height, out_h, y0, fy);
+		uint8_t *top = line, *bottom = line + width;
+		decode(y0, 0, width, top, width);
+		if(fy)  decode(y0 + 1, 0, width, bottom, width);
+		else  bottom = top;
+		
+		// Same positions as _bilinearPos, stepped as a quotient and a remainder: (2x + 1) * (W << 16) / (2w)
+		const uint64_t span = (uint64_t)width << 16, den = 2 * (uint32_t)out_w;
+		const uint32_t step = (2 * span) / den, step_rem = (2 * span) % den;
+		uint32_t q = span / den, rem = span % den;
+		const int32_t last = (int32_t)(width - 1) << 16;
+		for(uint16_t x = 0; x < out_w; x++){
+			int32_t p = (int32_t)q - 0x8000;
+			if(p < 0)  p = 0;
+			if(p > last)  p = last;
+			q += step;
+			rem += step_rem;
+			if(rem >= den){
+				rem -= den;
+				q++;
+			}
+			const uint32_t x0 = p >> 16, fx = (p >> 8) & 0xFF;
+			const uint32_t x1 = (fx)?  x0 + 1 : x0;
+			const uint32_t a = top[x0] * (256 - fx) + top[x1] * fx, b = bottom[x0] * (256 - fx) + bottom[x1] * fx;
+			dst[x] = (a * (256 - fy) + b * fy + 32768) >> 16;
+		}
+	}
+	
+	// Source position (integer part and 8 bit fraction) of the center of output pixel i, out of n, over a source of size
+	static void _bilinearPos(uint32_t i, uint32_t size, uint32_t n, uint32_t &i0, uint32_t &frac){
+		int32_t p = (int32_t)((2 * i + 1) * ((uint64_t)size << 16) / (2 * n)) - 0x8000;
+		const int32_t last = (int32_t)(size - 1) << 16;
+		if(p < 0)  p = 0;
+		if(p > last)  p = last;
+		i0 = p >> 16;
+		frac = (p >> 8) & 0xFF;
+	}
+	
+	// Fallback when the scratch cannot be allocated: nearest source pixel, decoded one at a time
+	void rowNearest(uint32_t r, uint8_t *dst, uint16_t out_w, uint16_t out_h) const{
+		const uint32_t y = (2 * r + 1) * height / (2 * (uint32_t)out_h);
+		for(uint16_t x = 0; x < out_w; x++)  decode(y, (2 * (uint32_t)x + 1) * width / (2 * (uint32_t)out_w), 1, dst + x, width);
+	}
+};
+
+// Settings of a single call, taken from the Dither object by _prepareCall()
+struct _DitherCall{
+	uint8_t *img;
+	uint16_t width, height;
+	uint32_t stride;						// bytes from one row of img to the next (see the out of place dither())
+	uint8_t quantization_bits;
+	bool invert_output;
+	uint8_t threads;
+	const uint8_t *levels;			// quantizer output for each value (see _levelTable)
+	const uint8_t *transfer;		// input transfer, or NULL
+	const _DitherSource *source;	// where the pixels are read from, or NULL (img itself)
+	uint16_t first_row, end_row;		// rows processed by the point operations (the whole image, except in frame mode)
+	uint16_t tile_size;							// tiled error diffusion (see setTiles); 0: exact
+	uint8_t tile_margin;
+	bool tile_noise;
+	const _EDFilterTaps *plan;			// custom filter (see setCustomFilter), or NULL
+	_PackedSink sink;
+	DitherStats *stats;							// see setStats
+	DitherStatsCallback stats_callback;
+	
+	// Input value of the pixels of row r, into dst: decoded from the source (if any), then mapped through the input transfer (if any)
+	inline void rowInput(uint32_t r, uint8_t *dst) const{
+		const uint8_t *p = img + r * stride;
+		if(source){
+			source->row(r, dst, width, height);
+			p = dst;
+		}
+		if(transfer){
+			for(uint16_t x = 0; x < width; x++)  dst[x] = transfer[p[x]];
+		}
+		else if(p != dst)  memcpy(dst, p, width);
+	}
+	
+	// Loads a row (error diffusion), right before any error can be diffused into it (so it only sees original pixel values)
+	inline void rowEnter(uint32_t r) const{
+		if((transfer == NULL  &&  source == NULL)  ||  r >= height)  return;
+		rowInput(r, img + r * stride);
+	}
+	
+	// Decodes a row from the source (point operations, which apply the transfer through their thresholds instead)
+	inline void rowDecode(uint32_t r) const{
+		if(source)  source->row(r, img + r * stride, width, height);
+	}
+	
+	inline void rowDone(uint16_t r) const{
+		if(sink.buffer)  sink.row(img, width, height, r, stride);
+	}
+};
+
+
+/*
+	Instrumentation (see setStats). The hooks below are macros that generate no code without DITHER_STATS; with it, they update the
+	statistics of the call running on the current thread (each worker thread has its own, merged at the end), if any.
+*/
+#if DITHER_STATS
+
+#if DITHER_THREADS
+	static thread_local DitherStats *_stats_now = NULL;
+#else
+	static DitherStats *_stats_now = NULL;
+#endif
+
+// Neighbour update v, about to be clamped to [0 : 255]
+#define _statsClamp(v)  do{ if(_stats_now  &&  ((v) < 0  ||  (v) > 255)){ _stats_now->clamped++;  _stats_now->clamped_error += ((v) < 0)?  -(v) : (v) - 255; } }while(0)
+// Quantization error of a pixel
+#define _statsError(err)  do{ if(_stats_now){ uint8_t _e = ((err) < 0)?  -(err) : (err);  _stats_now->error_sum += _e;  if(_e > _stats_now->error_peak)  _stats_now->error_peak = _e; } }while(0)
+// Error that could not be diffused
+#define _statsEdge(err)  do{ if(_stats_now)  _stats_now->edge_error += ((err) < 0)?  -(err) : (err); }while(0)
+
+static uint32_t _statsMicros(){
+	#if defined(ARDUINO)
+	return micros();
+	#else
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	#endif
+}
+
+// Statistics of a public call, from its start to the end of the scope; without a stats struct, a local one is passed to the callback
+struct _StatsScope{
+	DitherStats local, *stats, *outer;
+	DitherStatsCallback callback;
+	uint32_t start;
+	
+	_StatsScope(const _DitherCall &call, uint8_t algorithm){
+		callback = call.stats_callback;
+		stats = (call.stats)?  call.stats : (callback)?  &local : NULL;
+		if(stats == NULL)  return;
+		memset(stats, 0, sizeof(DitherStats));
+		stats->algorithm = algorithm;
+		stats->pixels = (uint32_t)call.width * call.height;
+		outer = _stats_now;
+		_stats_now = stats;
+		start = _statsMicros();
+	}
+	
+	~_StatsScope(){
+		if(stats == NULL)  return;
+		stats->time_us = _statsMicros() - start;
+		_stats_now = outer;
+		if(callback)  callback(*stats);
+	}
+};
+#define _statsScope(call, algorithm)  _StatsScope _stats_scope(call, algorithm)
+
+#if DITHER_THREADS
+static void _statsMerge(DitherStats &into, const DitherStats &part){
+	into.clamped += part.clamped;
+	into.clamped_error += part.clamped_error;
+	into.error_sum += part.error_sum;
+	if(part.error_peak > into.error_peak)  into.error_peak = part.error_peak;
+	into.edge_error += part.edge_error;
+}
+
+// Worker thread of a call: gathers statistics of its own, merged into the caller's ones (if any) when it ends.
+// _statsWorkers() goes in the calling function, before the workers start; _statsWorker() at the top of each worker.
+struct _StatsWorker{
+	DitherStats part, *caller;
+	std::mutex &lock;
+	
+	_StatsWorker(DitherStats *caller_stats, std::mutex &merge_lock) : caller(caller_stats), lock(merge_lock){
+		memset(&part, 0, sizeof(part));
+		_stats_now = (caller)?  &part : NULL;
+	}
+	
+	~_StatsWorker(){
+		_stats_now = caller;
+		if(caller == NULL)  return;
+		std::lock_guard<std::mutex> guard(lock);
+		_statsMerge(*caller, part);
+	}
+};
+#define _statsWorkers()  DitherStats *_stats_caller = _stats_now;  std::mutex _stats_lock
+#define _statsWorker()  _StatsWorker _stats_worker(_stats_caller, _stats_lock)
+#endif
+
+#else
+
+#define _statsClamp(v)  do{}while(0)
+#define _statsError(err)  do{}while(0)
+#define _statsEdge(err)  do{}while(0)
+#define _statsScope(call, algorithm)
+#define _statsWorkers()
+#define _statsWorker()
+
+#endif
 
 	// input image format MUST BE 256 shades of gray per pixel (monochrome). Use helper funtions (at the end of file) to up/downconvert the image if needed.
 Dither::Dither(uint16_t width, uint16_t height, 	// image parameters, used to define image boundaries
@@ -42,13 +467,22 @@ Dither::Dither(uint16_t width, uint16_t height, 	// image parameters, used to de
 	_img_width = width;
 	_img_height = height;
 	_invert_output = invert_output;
-	
-	// create a random buffer of values for temporal consistency used, if enabled, for random dithering
-  for(uint16_t i = 0; i < _rnd_frame_width; i++){
-  	_rnd_frame[i] = _Rnd();
-  	delayMicroseconds(3);
-  }
-  
+	_threads = 1;
+	_out_buffer = NULL;
+	_out_format = DITHER_OUT_BYTES;
+	_out_stride = 0;
+}
+
+
+Dither::~Dither(){
+	endStream();
+	endFrames();
+	_freePalette();
+	_matrixRelease(_matrix);
+	free(_transfer);
+	free(_custom);
+	free(_source);
+	free(_auto);
 }
 
 
@@ -57,6 +491,169 @@ void Dither::updateDimensions(uint16_t new_width, uint16_t new_height){
 	_img_height = new_height;
 }
 
+void Dither::setOutput(uint8_t *buffer, uint8_t format, uint32_t stride){
+	if(format == DITHER_OUT_BYTES)  buffer = NULL;
+	_out_buffer = buffer;
+	_out_format = (buffer == NULL)?  DITHER_OUT_BYTES : format;
+	_out_stride = stride;
+}
+
+int8_t Dither::setSource(const void *pixels, uint8_t format, uint8_t luma, uint32_t stride){
+	if(pixels == NULL){
+		free(_source);
+		_source = NULL;
+		_sourceScratch().release();
+		return 0;
+	}
+	if(format > DITHER_GRAY8  ||  luma > DITHER_LUMA_REC709)  return -1;
+	if(_source == NULL){
+		_source = (_DitherSource *)malloc(sizeof(_DitherSource));
+		if(_source == NULL)  return -1;		// not enough RAM
+		_source->width = _source->height = 0;
+		_source->resample = DITHER_RESAMPLE_AREA;
+	}
+	
+	_source->pixels = (const uint8_t *)pixels;
+	_source->format = format;
+	_source->stride = stride;
+	
+	// Weights in 1/256 (summing up to 256, rounded); the average uses 21846 / 65536, which gives (R + G + B) / 3 exactly up to 765
+	static const _DitherLuma lumas[] = {{1, 1, 1, 0, 21846}, {77, 150, 29, 128, 256}, {54, 183, 19, 128, 256}};
+	_source->luma = lumas[luma];
+	for(uint16_t c = 0; c < 256; c++){
+		uint8_t r, g, b;
+		color332To888(c, r, g, b);
+		_source->gray332[c] = ((uint32_t)(uint16_t)(r * _source->luma.r + g * _source->luma.g + b * _source->luma.b + _source->luma.bias) * _source->luma.scale) >> 16;
+	}
+	return 0;
+}
+
+int8_t Dither::setSourceSize(uint16_t width, uint16_t height, uint8_t resample){
+	if(_source == NULL  ||  resample > DITHER_RESAMPLE_BILINEAR  ||  (width == 0) != (height == 0))  return -1;
+	_source->width = width;
+	_source->height = height;
+	_source->resample = resample;
+	return 0;
+}
+
+void Dither::_prepareCall(_DitherCall &call, uint8_t *IMG_pixel, uint8_t quantization_bits){
+	call.img = IMG_pixel;
+	call.width = _img_width;
+	call.height = _img_height;
+	call.stride = _img_stride?  _img_stride : _img_width;
+	call.quantization_bits = quantization_bits;
+	call.invert_output = _invert_output;
+	call.threads = _threads;
+	call.levels = (quantization_bits >= 1  &&  quantization_bits <= 8)?  _levelTable(quantization_bits) : NULL;
+	call.transfer = _transfer;
+	call.source = _source;
+	call.first_row = 0;
+	call.end_row = _img_height;
+	call.tile_size = _tile_size;
+	call.tile_margin = _tile_margin;
+	call.tile_noise = _tile_noise;
+	call.plan = _custom;
+	
+	call.stats = _stats;
+	call.stats_callback = _stats_callback;
+	
+	call.sink.buffer = _out_buffer;
+	call.sink.format = _out_format;
+	call.sink.stride = _outStride(_out_format, _out_stride);
+	call.sink.quantization_bits = quantization_bits;
+}
+
+uint32_t Dither::_outStride(uint8_t format, uint32_t stride){
+	if(stride)  return stride;
+	switch(format){
+		case DITHER_OUT_BYTES:  return _img_width;
+		case DITHER_OUT_SSD1306:  return _img_width;
+		case DITHER_OUT_2BPP:  return (_img_width + 3) / 4;
+		case DITHER_OUT_4BPP:  return (_img_width + 1) / 2;
+		default:  return (_img_width + 7) / 8;		// DITHER_OUT_1BPP, DITHER_OUT_PBM, DITHER_OUT_BITPLANES
+	}
+}
+
+uint32_t Dither::outputSize(uint8_t format, uint32_t stride, uint8_t quantization_bits){
+	stride = _outStride(format, stride);
+	if(format == DITHER_OUT_SSD1306)  return stride * ((_img_height + 7) / 8);
+	if(format == DITHER_OUT_BITPLANES)  return stride * _img_height * quantization_bits;
+	return stride * _img_height;
+}
+
+void Dither::setThreads(uint8_t threads){
+	_threads = threads;
+}
+
+int8_t Dither::setTiles(uint16_t tile_size, uint8_t margin, bool seam_noise){
+	if(tile_size > 0  &&  tile_size < 8)  return -1;		// smaller tiles would be mostly warm-up
+	_tile_size = tile_size;
+	_tile_margin = margin;
+	_tile_noise = seam_noise;
+	return 0;
+}
+
+void Dither::_packRow(const uint8_t *src, uint8_t *dst, uint32_t width, uint8_t format){
+	_PackedSink::packRow(src, dst, width, format);
+}
+
+int8_t Dither::setStats(DitherStats *stats, DitherStatsCallback callback){
+	#if DITHER_STATS
+	_stats = stats;
+	_stats_callback = callback;
+	return 0;
+	#else
+	(void)stats;
+	(void)callback;
+	return -1;		// instrumentation not built in
+	#endif
+}
+
+// Quantizer table: one lookup per pixel replaces the shift, the multiplication and the inversion (output ^ 0xFF gives back the level).
+const uint8_t *Dither::_levelTable(uint8_t quantization_bits){
+	if(quantization_bits != _levels_bits  ||  _invert_output != _levels_inverted){
+		const uint8_t shifter = 8 - quantization_bits;
+		const uint8_t quant_step = 255 / ((1 << quantization_bits) - 1);
+		const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+		for(uint16_t v = 0; v < 256; v++)  _levels[v] = ((v >> shifter) * quant_step) ^ out_mask;
+		_levels_bits = quantization_bits;
+		_levels_inverted = _invert_output;
+	}
+	return _levels;
+}
+
+// Builds the input transfer table and its inverse. The transfer never decreases, so "transfer[p] >= t" is the same as "p >= inverse[t]":
+// this lets the point-operation algorithms compare the original pixels against mapped thresholds, keeping their row primitives as they are.
+int8_t Dither::setTransfer(float gamma, int8_t contrast, int8_t brightness){
+	
+	if(gamma <= 0)  return -1;
+	_frame_primed = false;
+	if(gamma == 1.0  &&  contrast == 0  &&  brightness == 0){		// identity
+		free(_transfer);
+		_transfer = NULL;
+		return 0;
+	}
+	if(_transfer == NULL){
+		_transfer = (uint8_t *)malloc(512);
+		if(_transfer == NULL)  return -1;		// not enough RAM
+	}
+	
+	const float gain = (128 + contrast) / 128.0;		// contrast in [-128 : +127] scales the distance from mid-gray by [0 : ~2]
+	for(uint16_t v = 0; v < 256; v++){
+		float y = 255 * pow(v / 255.0, gamma);
+		y = (y - 128) * gain + 128 + brightness;
+		_transfer[v] = (y <= 0)?  0 : (y >= 255)?  255 : (uint8_t)(y + 0.5);
+	}
+	
+	// inverse[t]: smallest value p with transfer[p] >= t (255 when there is none; thresholds above transfer[255] are handled apart)
+	uint16_t p = 0;
+	for(uint16_t t = 0; t < 256; t++){
+		while(p < 255  &&  _transfer[p] < t)  p++;
+		_transfer[256 + t] = p;
+	}
+	return 0;
+}
+
 uint16_t Dither::getWidth(){
 	return _img_width;
 }
@@ -66,63 +663,663 @@ uint16_t Dither::getHeight(){
 }
 
 void Dither::reRandomizeBuffer(){
-	// recreate the random buffer for temporal consistency used, if enabled, for random dithering
-  for(uint16_t i = 0; i < _rnd_frame_width; i++){
-  	_rnd_frame[i] = _Rnd();
-  	delayMicroseconds(3);
-  }
+	setNoise(_noise_seed * 1664525 + 1013904223, _noise_frame);		// next seed of a LCG: seeds are hashed anyway
+}
+
+void Dither::setNoise(uint32_t seed, uint32_t frame){
+	_noise_seed = seed;
+	_noise_frame = frame;
+	_frame_primed = false;
 }
 
 
 // ERROR-DIFFUSION Algorithms
 
+/*
+	Compile-time error-diffusion kernels.
+	The coefficient lists found in Dither.h (e.g. FSf_coeffs) are walked by the templates below exactly as _GPEDDither walks the _filters[][] table,
+	but while compiling: each neighbour update is unrolled into a fixed pointer offset, the divisor is turned into a bitshift (powers of 2) or into a
+	reciprocal multiplication (any other divisor), and the edge test is moved out of the pixel loop by splitting each row into border and interior spans.
+	The output is the same as the one of _GPEDDither, edge behaviour included.
+*/
+
+// Filter shape, derived the same way as in _GPEDDither: "width" counts the weights on the pivot row, "height" counts linefeeds (and zero weights).
+template<bool LF, int8_t... C> struct _EDShape;
+template<bool LF> struct _EDShape<LF>{
+	static const uint8_t width = 0, height = 0;
+};
+template<bool LF, int8_t C0, int8_t... C> struct _EDShape<LF, C0, C...>{
+	typedef _EDShape<(LF || C0 <= 0), C...> next;
+	static const uint8_t width = next::width + ((!LF && C0 > 0)? 1 : 0);
+	static const uint8_t height = next::height + ((C0 <= 0)? 1 : 0);
+};
+
+// Weight normalization: bitshift when the divisor is a power of 2, otherwise multiplication by a 21 bit fixed point reciprocal.
+// The reciprocal is rounded up, which keeps the result equal to the (truncating) integer division for every |numerator| <= 255 * 127.
+#define _recip_shift  21
+template<uint8_t DIV, bool POW2 = is_2s_pow(DIV)> struct _EDNorm{
+	static const uint32_t recip = ((1UL << _recip_shift) + DIV - 1) / DIV;
+	static_assert((recip * DIV - (1UL << _recip_shift)) * 32768UL < (1UL << _recip_shift), "divisor cannot be turned into an exact reciprocal");
+	static inline int16_t scale(int16_t num){
+		return (num >= 0)?  (int16_t)(((uint32_t)num * recip) >> _recip_shift) : -(int16_t)(((uint32_t)(-num) * recip) >> _recip_shift);
+	}
+};
+template<uint8_t DIV> struct _EDNorm<DIV, true>{
+	static const uint8_t shift = (DIV >= 128)? 7 : (DIV >= 64)? 6 : (DIV >= 32)? 5 : (DIV >= 16)? 4 : (DIV >= 8)? 3 : (DIV >= 4)? 2 : (DIV >= 2)? 1 : 0;
+	static inline int16_t scale(int16_t num){
+		return num >> shift;
+	}
+};
+
+// Single neighbour update at (COL, ROW) relative to the pivot pixel; zero (or negative) weights generate no code.
+template<uint8_t DIV, int8_t ROW, int8_t COL, int8_t W, bool ACTIVE = (W > 0)> struct _EDTap{
+	static inline void apply(uint8_t *pix, int16_t err, uint32_t stride){
+		uint8_t *n = pix + COL + (int32_t)ROW * stride;
+		int16_t v = *n + _EDNorm<DIV>::scale(err * W);
+		_statsClamp(v);
+		*n = (v < 0)? 0 : (v > 255)? 255 : v;
+	}
+};
+template<uint8_t DIV, int8_t ROW, int8_t COL, int8_t W> struct _EDTap<DIV, ROW, COL, W, false>{
+	static inline void apply(uint8_t *, int16_t, uint32_t){}
+};
+
+// Walks the coefficient list; a negative entry is a linefeed that moves the cursor to the next row, |entry| columns left of the pivot.
+template<uint8_t DIV, int8_t ROW, int8_t COL, int8_t... C> struct _EDTaps;
+template<uint8_t DIV, int8_t ROW, int8_t COL> struct _EDTaps<DIV, ROW, COL>{
+	static inline void apply(uint8_t *, int16_t, uint32_t){}
+};
+template<uint8_t DIV, int8_t ROW, int8_t COL, int8_t C0, int8_t... C> struct _EDTaps<DIV, ROW, COL, C0, C...>{
+	static inline void apply(uint8_t *pix, int16_t err, uint32_t stride){
+		_EDTap<DIV, ROW, COL, C0>::apply(pix, err, stride);
+		_EDTaps<DIV, (C0 < 0)? ROW + 1 : ROW, (C0 < 0)? C0 : COL + 1, C...>::apply(pix, err, stride);
+	}
+};
+
+// Neighbour update queued by a wavefront worker (see _wavefrontRun below)
+struct _EDDeferred{
+	uint8_t *pix;
+	int16_t delta;
+};
+#define max_deferred_updates  32
+
+// How a row span is processed: normally, also recording the value each pixel is quantized from, or replaying the error diffusion
+// of an already dithered row from its recorded values (the last two are used by the frame mode, see ditherFrame).
+#define _span_run     0
+#define _span_record  1
+#define _span_replay  2
+
+template<uint8_t MODE>
+static inline uint8_t _spanValue(const uint8_t *line, uint8_t *vals, uint32_t col){
+	if(MODE == _span_replay)  return vals[col];
+	if(MODE == _span_record)  vals[col] = line[col];
+	return line[col];
+}
+
+// Row-span part shared by the error diffusion kernels (K: the kernel itself, which provides interior() and leftEdge()). Each row is split into:
+// left border pixel, left edge pixels (whose taps may reach columns < 0, see leftEdge), interior pixels (no checks) and right border pixels;
+// the last "below" rows are only quantized.
+template<class K>
+struct _EDRows{
+	uint8_t *img;
+	uint16_t width, height;
+	uint32_t stride;
+	const uint8_t *levels;
+	uint8_t out_mask;
+	uint8_t below;									// rows reached below the pivot
+	int32_t last_row, last_col;			// pixels diffuse their error only if row < last_row and 0 < col < last_col
+	uint8_t left, right;						// columns reached on each side of the pivot
+	bool defer;											// queue the updates that wrap around the left edge (wavefront mode)
+	uint8_t deferred_count;
+	_EDDeferred deferred[max_deferred_updates];
+	
+	void init(const _DitherCall &call, uint8_t rows_below, uint8_t pivot_width){
+		img = call.img;
+		width = call.width;
+		height = call.height;
+		stride = call.stride;
+		levels = call.levels;
+		out_mask = call.invert_output?  0xFF : 0x00;		// levels[] holds q ^ out_mask, as 0xFF - q == q ^ 0xFF
+		below = rows_below;
+		last_row = (int32_t)height - rows_below;
+		last_col = (int32_t)width - pivot_width;
+		defer = false;
+		deferred_count = 0;
+	}
+	
+	inline void border(uint8_t *pix, uint8_t v){
+		*pix = levels[v];
+		_statsError((int16_t)v - (*pix ^ out_mask));
+		_statsEdge((int16_t)v - (*pix ^ out_mask));
+	}
+	
+	// Neighbour update of a left edge pixel: queued when rows run in parallel and it wraps around the left edge, to be applied in the serial order by flush().
+	// n is pix + dx + dy * stride: a wrapped tap is moved back onto the last columns of the previous row, past the padding (if any) between rows.
+	// Taps reaching further left than a whole row (custom filters wider than the image) are dropped, since they would wrap more than once.
+	inline void edgeUpdate(uint8_t *n, int16_t delta, int32_t col){
+		if(col < -(int32_t)width)  return;
+		if(col < 0)  n -= stride - width;
+		if(defer  &&  col < 0){
+			deferred[deferred_count].pix = n;
+			deferred[deferred_count].delta = delta;
+			deferred_count++;
+		}
+		else{
+			int16_t t = *n + delta;
+			_statsClamp(t);
+			*n = (t < 0)? 0 : (t > 255)? 255 : t;
+		}
+	}
+	
+	void flush(){
+		for(uint8_t d = 0; d < deferred_count; d++){
+			int16_t t = *deferred[d].pix + deferred[d].delta;
+			_statsClamp(t);
+			*deferred[d].pix = (t < 0)? 0 : (t > 255)? 255 : t;
+		}
+		deferred_count = 0;
+	}
+	
+	// Processes columns [c0, c1) of a row; vals: recorded values of the row (record and replay modes only)
+	template<uint8_t MODE>
+	void span(uint16_t row, uint32_t c0, uint32_t c1, uint8_t *vals){
+		K &k = *static_cast<K *>(this);
+		uint8_t *line = img + (uint32_t)row * stride;
+		uint32_t col = c0;
+		
+		if(row < last_row  &&  last_col > 1){
+			if(col == 0  &&  c1 > 0){
+				border(line, _spanValue<MODE>(line, vals, 0));
+				col++;
+			}
+			
+			uint32_t edge_end = (left < last_col)?  left : last_col;
+			if(edge_end > c1)  edge_end = c1;
+			for(; col < edge_end; col++)  k.leftEdge(line + col, _spanValue<MODE>(line, vals, col), col);
+			
+			uint32_t interior_end = ((uint32_t)last_col < c1)?  last_col : c1;
+			if(col < interior_end)  k.template interiorSpan<MODE>(line, vals, col, interior_end);
+			col = (col > interior_end)?  col : interior_end;
+		}
+		
+		for(; col < c1; col++)  border(line + col, _spanValue<MODE>(line, vals, col));
+	}
+	
+	// Interior pixels [c0, c1) of a row; a kernel may replace it, to keep its state in registers along the span
+	template<uint8_t MODE>
+	inline void interiorSpan(uint8_t *line, uint8_t *vals, uint32_t c0, uint32_t c1){
+		K &k = *static_cast<K *>(this);
+		for(uint32_t col = c0; col < c1; col++)  k.interior(line + col, _spanValue<MODE>(line, vals, col));
+	}
+	
+	void run(uint16_t row, uint32_t c0, uint32_t c1){
+		span<_span_run>(row, c0, c1, NULL);
+	}
+	
+	// Column at which a row must see the previous one completed, and flush its queued updates (first column writing where wrapped taps land)
+	uint32_t syncColumn(){
+		if(left < 2  ||  last_col <= 1)  return width;
+		return width + 1 - left - right;
+	}
+};
+
+// Compile-time kernel of one built-in filter: unrolled taps
+template<uint8_t DIV, int8_t... C>
+struct _EDKernel : _EDRows<_EDKernel<DIV, C...> >{
+	typedef _EDShape<false, C...> shape;
+	typedef _EDTaps<DIV, 0, 1, C...> taps;
+	static const uint8_t tap_bound = max_filter_entries;		// most taps a pixel can have
+	
+	_EDKernel(const _DitherCall &call){
+		this->init(call, shape::height, shape::width);
+		
+		static const int8_t coeffs[] = {C...};
+		int8_t col_offs = 1;
+		this->left = 0;
+		this->right = 0;
+		for(uint8_t p = 0; p < sizeof(coeffs); p++){
+			if(coeffs[p] < 0){
+				col_offs = coeffs[p];
+				if(-col_offs > this->left)  this->left = -col_offs;
+			}
+			else{
+				if(coeffs[p] > 0  &&  col_offs > (int8_t)this->right)  this->right = col_offs;
+				col_offs++;
+			}
+		}
+	}
+	
+	inline void interior(uint8_t *pix, uint8_t v){
+		uint8_t out = this->levels[v];
+		int16_t err = (int16_t)v - (out ^ this->out_mask);
+		*pix = out;
+		_statsError(err);
+		taps::apply(pix, err, this->stride);
+	}
+	
+	// Pixels closer than "left" columns to the left edge: as in _GPEDDither, taps reaching a negative column land at the end of the
+	// previous row (x + y * width indexing).
+	void leftEdge(uint8_t *pix, uint8_t v, int32_t col){
+		static const int8_t coeffs[] = {C...};
+		uint8_t out = this->levels[v];
+		int16_t err = (int16_t)v - (out ^ this->out_mask);
+		*pix = out;
+		_statsError(err);
+		
+		int8_t row_offs = 0, col_offs = 1;
+		for(uint8_t p = 0; p < sizeof(coeffs); p++){
+			if(coeffs[p] < 0){
+				col_offs = coeffs[p];
+				row_offs++;
+				continue;
+			}
+			if(coeffs[p] > 0){
+				this->edgeUpdate(pix + col_offs + (int32_t)row_offs * this->stride, _EDNorm<DIV>::scale(err * coeffs[p]), col + col_offs);
+			}
+			col_offs++;
+		}
+	}
+};
+
+// Runtime kernel of a custom filter (see setCustomFilter), from the plan compiled at registration: the neighbour offsets are flattened
+// once per call, for the width of the image, and the normalization is fixed by POW2 (bitshift, else reciprocal), chosen with the plan.
+// Same edge behaviour as _EDKernel: a custom filter with the taps of a built-in one gives the same output.
+template<bool POW2>
+struct _PlanKernel : _EDRows<_PlanKernel<POW2> >{
+	uint8_t tap_bound;				// taps of the filter
+	uint8_t shift;
+	uint32_t recip;
+	int32_t offset[DITHER_MAX_FILTER_TAPS];
+	int16_t weight[DITHER_MAX_FILTER_TAPS];
+	int8_t dx[DITHER_MAX_FILTER_TAPS];
+	
+	_PlanKernel(const _DitherCall &call){
+		const _EDFilterTaps &plan = *call.plan;
+		this->init(call, plan.height, plan.width);
+		this->left = plan.left;
+		this->right = plan.right;
+		tap_bound = plan.count;
+		shift = plan.shift;
+		recip = plan.recip;
+		for(uint8_t t = 0; t < tap_bound; t++){
+			offset[t] = plan.dx[t] + (int32_t)plan.dy[t] * this->stride;
+			weight[t] = plan.weight[t];
+			dx[t] = plan.dx[t];
+		}
+	}
+	
+	// Error share of a tap, as _normalizeError() computes it (sign and mag: of err, for the reciprocal)
+	static inline int16_t share(int16_t err, int32_t sign, uint32_t mag, int16_t w, uint8_t sh, uint32_t rc){
+		return POW2?  (int16_t)(err * w) >> sh : ((int32_t)((mag * w * rc) >> sh) ^ sign) - sign;
+	}
+	
+	// The plan is copied to locals first: image writes (uint8_t) may alias any object, but not locals whose address is never taken
+	template<uint8_t MODE>
+	void interiorSpan(uint8_t *line, uint8_t *vals, uint32_t c0, uint32_t c1){
+		const uint8_t *levels = this->levels, out_mask = this->out_mask, sh = shift;
+		const uint32_t rc = recip;
+		const uint8_t count = tap_bound;
+		int32_t off[DITHER_MAX_FILTER_TAPS];
+		int16_t w[DITHER_MAX_FILTER_TAPS];
+		for(uint8_t t = 0; t < count; t++){
+			off[t] = offset[t];
+			w[t] = weight[t];
+		}
+		
+		for(uint32_t col = c0; col < c1; col++){
+			uint8_t v = _spanValue<MODE>(line, vals, col);
+			uint8_t *pix = line + col;
+			uint8_t out = levels[v];
+			int16_t err = (int16_t)v - (out ^ out_mask);
+			*pix = out;
+			_statsError(err);
+			
+			const int32_t sign = (err < 0)?  -1 : 0;
+			const uint32_t mag = (err < 0)?  -err : err;
+			for(uint8_t t = 0; t < count; t++){
+				uint8_t *n = pix + off[t];
+				int16_t u = *n + share(err, sign, mag, w[t], sh, rc);
+				_statsClamp(u);
+				*n = (u < 0)? 0 : (u > 255)? 255 : u;
+			}
+		}
+	}
+	
+	void leftEdge(uint8_t *pix, uint8_t v, int32_t col){
+		uint8_t out = this->levels[v];
+		int16_t err = (int16_t)v - (out ^ this->out_mask);
+		*pix = out;
+		_statsError(err);
+		
+		const int32_t sign = (err < 0)?  -1 : 0;
+		const uint32_t mag = (err < 0)?  -err : err;
+		for(uint8_t t = 0; t < tap_bound; t++)  this->edgeUpdate(pix + offset[t], share(err, sign, mag, weight[t], shift, recip), col + dx[t]);
+	}
+};
+
+
+#if DITHER_THREADS
+
+/*
+	Wavefront scheduling: rows are dealt to the workers in turn, and a row only processes columns [c0, c1) once the row above has completed
+	c1 + lag columns, lag being the total reach of the filter (left + right). Every pixel then reads and writes its neighbours in the same
+	order as the serial loop does, so the output is the same, bit for bit.
+	Progress counters are per row, and are published after each chunk of columns.
+*/
+#define _wavefront_chunk  32
+
+template<class KERNEL>
+static void _wavefrontRun(KERNEL &kernel, const _DitherCall &call, uint8_t lag, uint32_t sync_col, uint8_t threads){
+	
+	const uint16_t width = call.width, height = call.height;
+	
+	std::atomic<uint32_t> *progress = new std::atomic<uint32_t>[height];
+	for(uint16_t r = 0; r < height; r++)  progress[r].store(0, std::memory_order_relaxed);
+	
+	_statsWorkers();
+	
+	auto worker = [&](uint8_t id){
+		_statsWorker();
+		KERNEL k = kernel;		// private copy: each worker has its own queue of deferred updates
+		k.defer = true;
+		
+		for(uint32_t row = id; row < height; row += threads){
+			call.rowEnter(row + k.below);		// nothing else can reach that row before this one has started
+			uint32_t col = 0;
+			while(col < width){
+				uint32_t end = col + _wavefront_chunk;
+				if(end > width)  end = width;
+				if(col < sync_col  &&  end > sync_col)  end = sync_col;
+				
+				if(row > 0){
+					uint32_t need = (col == sync_col)?  width : end + lag;
+					if(need > width)  need = width;
+					while(progress[row - 1].load(std::memory_order_acquire) < need)  std::this_thread::yield();
+				}
+				if(col == sync_col)  k.flush();
+				
+				k.run(row, col, end);
+				col = end;
+				progress[row].store(col, std::memory_order_release);
+			}
+			call.rowDone(row);
+		}
+	};
+	
+	std::thread *pool = new std::thread[threads - 1];
+	for(uint8_t t = 1; t < threads; t++)  pool[t - 1] = std::thread(worker, t);
+	worker(0);
+	for(uint8_t t = 1; t < threads; t++)  pool[t - 1].join();
+	
+	delete[] pool;
+	delete[] progress;
+}
+
+static uint8_t _workerCount(uint8_t threads, uint16_t height){
+	if(threads == 0){		// as many workers as cores
+		unsigned hw = std::thread::hardware_concurrency();
+		threads = (hw == 0)?  1 : (hw > 255)?  255 : hw;
+	}
+	return (threads > height)?  height : threads;
+}
+
+#endif
+
+
+/*
+	Tiled error diffusion (see setTiles): an approximation of the serial output, with no dependency at all between tiles.
+	Each tile is dithered in a window of its own, copied from a snapshot of the source image: the window also holds "margin" columns
+	on each side and "margin" rows above the tile, whose error reaches the tile much as in the serial run (warm-up), and the rows the
+	filter reaches below it, so that the last rows of the tile diffuse their error as usual. Only the tile itself is written back.
+	With seam noise, the first row and column of the warm-up are perturbed, so that the error patterns of neighbouring tiles do not all
+	start in the same phase. The noise only depends on the pixel coordinates: the output never depends on the number of threads.
+*/
+#define _tile_noise_shift  1		// seam noise amplitude: +-128 >> (quantization bits + _tile_noise_shift)
+
+static inline uint32_t _noiseMix(uint32_t h);		// see Other dithering Algorithms
+
+struct _TileGrid{
+	uint16_t size, margin, below;
+	uint32_t columns, count;
+	
+	_TileGrid(const _DitherCall &call, uint8_t rows_below){
+		size = call.tile_size;
+		margin = call.tile_margin;
+		below = rows_below;
+		columns = ((uint32_t)call.width + size - 1) / size;
+		count = columns * (((uint32_t)call.height + size - 1) / size);
+	}
+	
+	uint32_t windowBytes(const _DitherCall &call) const{		// largest window
+		uint32_t w = (uint32_t)size + 2 * margin, h = (uint32_t)size + margin + below;
+		return ((w < call.width)?  w : call.width) * ((h < call.height)?  h : call.height);
+	}
+};
+
+template<class KERNEL>
+static void _tileDither(const _DitherCall &call, const _TileGrid &grid, const uint8_t *source, uint8_t *window, uint32_t tile){
+	
+	const uint32_t x0 = tile % grid.columns * grid.size, y0 = tile / grid.columns * grid.size;
+	const uint32_t x1 = (x0 + grid.size < call.width)?  x0 + grid.size : call.width;
+	const uint32_t y1 = (y0 + grid.size < call.height)?  y0 + grid.size : call.height;
+	const uint32_t wx0 = (x0 > grid.margin)?  x0 - grid.margin : 0, wy0 = (y0 > grid.margin)?  y0 - grid.margin : 0;
+	const uint32_t wx1 = (x1 + grid.margin < call.width)?  x1 + grid.margin : call.width;
+	const uint32_t wy1 = (y1 + grid.below < call.height)?  y1 + grid.below : call.height;
+	
+	_DitherCall w = call;
+	w.img = window;
+	w.width = wx1 - wx0;
+	w.height = wy1 - wy0;
+	w.stride = w.width;
+	w.transfer = NULL;			// already applied to the snapshot
+	w.source = NULL;
+	w.sink.buffer = NULL;
+	for(uint32_t y = wy0; y < wy1; y++)  memcpy(window + (y - wy0) * w.width, source + y * call.width + wx0, w.width);
+	
+	if(call.tile_noise){
+		const uint8_t shift = call.quantization_bits + _tile_noise_shift;
+		auto perturb = [&](uint32_t x, uint32_t y){
+			uint8_t *p = window + (y - wy0) * w.width + (x - wx0);
+			int16_t v = *p + (((int16_t)(_noiseMix(_noiseMix(y * 0x85EBCA6B) + x * 0xC2B2AE35) >> 24) - 128) >> shift);
+			*p = (v < 0)? 0 : (v > 255)? 255 : v;
+		};
+		if(wy0 < y0){
+			for(uint32_t x = wx0; x < wx1; x++)  perturb(x, wy0);
+		}
+		if(wx0 < x0){
+			for(uint32_t y = wy0 + (wy0 < y0); y < wy1; y++)  perturb(wx0, y);
+		}
+	}
+	
+	KERNEL kernel(w);
+	for(uint16_t row = 0; row < w.height; row++)  kernel.run(row, 0, w.width);
+	
+	for(uint32_t y = y0; y < y1; y++)  memcpy(call.img + y * call.stride + x0, window + (y - wy0) * w.width + (x0 - wx0), x1 - x0);
+}
+
+template<class KERNEL>
+static int8_t _tiledRun(const KERNEL &kernel, const _DitherCall &call){
+	
+	const _TileGrid grid(call, kernel.below);
+	const uint32_t pixels = (uint32_t)call.width * call.height;
+	
+	// Tiles read their windows from the snapshot, while the image is being written
+	uint8_t *source = (uint8_t *)malloc(pixels);
+	if(source == NULL)  return -1;
+	for(uint32_t r = 0; r < call.height; r++)  call.rowInput(r, source + r * call.width);
+	
+	uint32_t next_tile = 0;
+	
+	#if DITHER_THREADS
+	// Tiles are taken one at a time by the workers, so that they stay busy until the last one, whatever the tile count
+	uint8_t threads = _workerCount(call.threads, (grid.count < 0xFFFF)?  grid.count : 0xFFFF);
+	if(threads > 1){
+		std::atomic<uint32_t> next(0);
+		_statsWorkers();
+		
+		auto worker = [&](){
+			_statsWorker();
+			uint8_t *window = (uint8_t *)malloc(grid.windowBytes(call));
+			if(window == NULL)  return;		// the other workers (or the caller, below) take its share
+			for(uint32_t tile = next++; tile < grid.count; tile = next++)  _tileDither<KERNEL>(call, grid, source, window, tile);
+			free(window);
+		};
+		
+		std::thread *pool = new std::thread[threads - 1];
+		for(uint8_t t = 1; t < threads; t++)  pool[t - 1] = std::thread(worker);
+		worker();
+		for(uint8_t t = 1; t < threads; t++)  pool[t - 1].join();
+		delete[] pool;
+		
+		next_tile = (next < grid.count)?  next.load() : grid.count;
+	}
+	#endif
+	
+	if(next_tile < grid.count){
+		uint8_t *window = (uint8_t *)malloc(grid.windowBytes(call));
+		if(window == NULL){
+			free(source);
+			return -1;
+		}
+		for(; next_tile < grid.count; next_tile++)  _tileDither<KERNEL>(call, grid, source, window, next_tile);
+		free(window);
+	}
+	
+	free(source);
+	for(uint16_t row = 0; row < call.height; row++)  call.rowDone(row);
+	return 0;
+}
+
+
+// Runs an error diffusion kernel (_EDKernel or _PlanKernel) on the whole image: in tiles, as a wavefront, or serially
+template<class KERNEL>
+static int8_t _kernelDither(KERNEL &kernel, const _DitherCall &call){
+	
+	if(call.tile_size)  return _tiledRun(kernel, call);
+	
+	for(uint8_t r = 0; r < kernel.below; r++)  call.rowEnter(r);
+	
+	#if DITHER_THREADS
+	uint8_t threads = _workerCount(call.threads, call.height);
+	uint8_t lag = kernel.left + kernel.right;
+	// Narrow images (or filters reaching too far on the left) are not worth the threads
+	if(threads > 1  &&  call.width >= 4 * (uint32_t)(lag + _wavefront_chunk)  &&  kernel.left * kernel.tap_bound <= max_deferred_updates){
+		_wavefrontRun(kernel, call, lag, kernel.syncColumn(), threads);
+		return 0;
+	}
+	#endif
+	
+	for(uint16_t row = 0; row < call.height; row++){
+		call.rowEnter(row + kernel.below);
+		kernel.run(row, 0, call.width);
+		call.rowDone(row);
+	}
+	
+	return 0;		// Everything ok
+}
+
+template<uint8_t DIV, int8_t... C>
+static int8_t _EDDither(const _DitherCall &call){
+	
+	if(call.quantization_bits < 1  ||  call.quantization_bits > 7){
+		return -1;	// quantization bits not valid
+	}
+	
+	_EDKernel<DIV, C...> kernel(call);
+	return _kernelDither(kernel, call);
+}
+
+
 // Standard Floyd-Steinberg dithering filter
 int8_t Dither::FSDither(uint8_t *IMG_pixel, uint8_t quantization_bits){  // quantization_bits: number of bits between 1 and 7 used to represent the OUTPUT grayshades
-	return _GPEDDither(IMG_pixel, quantization_bits, FSf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_FS);
+	return _EDDither<FSf_coeffs>(call);
 }
 
 // Jarvis, Judice, and Ninke filter
 int8_t Dither::JJNDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, JJNf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_JJN);
+	return _EDDither<JJNf_coeffs>(call);
 }
 
 // Stucki filter
 int8_t Dither::StuckiDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, STUf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_STUCKI);
+	return _EDDither<STUf_coeffs>(call);
 }
 
 // Burkes filter
 int8_t Dither::BurkesDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, BURf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_BURKES);
+	return _EDDither<BURf_coeffs>(call);
 }
 
 // Sierra 3 filter
 int8_t Dither::Sierra3Dither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, SIE3f);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_SIERRA3);
+	return _EDDither<SIE3f_coeffs>(call);
 }
 
 // Sierra 2 filter
 int8_t Dither::Sierra2Dither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, SIE2f);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_SIERRA2);
+	return _EDDither<SIE2f_coeffs>(call);
 }
 
 // Sierra 2-4A filter
 int8_t Dither::Sierra24ADither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, SIE24f);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_SIERRA24A);
+	return _EDDither<SIE24f_coeffs>(call);
 }
 
 // Atkinson filter
 int8_t Dither::AtkinsonDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, ATKf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_ATKINSON);
+	return _EDDither<ATKf_coeffs>(call);
 }
 
 // Personal filter
 int8_t Dither::PersonalFilterDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
-  return _GPEDDither(IMG_pixel, quantization_bits, PERf);
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_PERSONAL);
+	return _EDDither<PERf_coeffs>(call);
+}
+
+// Custom filter (see setCustomFilter)
+int8_t Dither::CustomFilterDither(uint8_t *IMG_pixel, uint8_t quantization_bits){
+	if(_custom == NULL  ||  quantization_bits < 1  ||  quantization_bits > 7)  return -1;		// no filter registered, or quantization bits not valid
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_CUSTOM);
+	if(_custom->recip){
+		_PlanKernel<false> kernel(call);
+		return _kernelDither(kernel, call);
+	}
+	_PlanKernel<true> kernel(call);
+	return _kernelDither(kernel, call);
 }
 
 
-// General Purpose Error Distribution dithering structure
+// General Purpose Error Distribution dithering structure.
+// The public filter functions run the compile-time kernels above; this interpreter of the _filters[][] table is kept as the reference they are
+// checked against (dither_bench --check, in extras/benchmark).
 int8_t Dither::_GPEDDither(uint8_t *IMG_pixel, uint8_t quantization_bits, uint8_t filter_index){
 	
   if(quantization_bits < 1  ||  quantization_bits > 7){
@@ -245,163 +1442,448 @@ int8_t Dither::_GPEDDither(uint8_t *IMG_pixel, uint8_t quantization_bits, uint8_
   return 0;		// Everything ok
 }
 
-// Fast Error Diffusion Dithering algorithm
-void Dither::fastEDDither(uint8_t *IMG_pixel){
-  
-  uint8_t c;
-  uint8_t newc;
-  int16_t temp_c;
-  int8_t quant_err_c;
-  uint32_t ind;
-
-  for(uint16_t row = 0; row < _img_height; row++){
-    for(uint16_t col = 0; col < _img_width; col++){
-      
-      ind = index(col, row);
-    	
-      c = IMG_pixel[ind];
-
-      newc = c;
-
-      quantize_BW(newc);
-
-      quant_err_c = (c - newc) >> 1;
-      
-      if(_invert_output)	newc = 0xFF - newc;
-      IMG_pixel[ind] = newc;
-      
-      // adjacent pixels work starts here:
-      // distribute part of error at (x + 1, y)      
-      if(col != (_img_width - 1)){
-      	
-      	ind = index(col + 1, row);
-        c = IMG_pixel[ind];
-        
-        temp_c = c + quant_err_c;
-        
-        IMG_pixel[ind] = _clamp(temp_c, 0, 255);
-
-      }
-
-      // distribute part of error at (x, y + 1)
-      if(row != (_img_height - 1)){
-      	
-        ind = index(col, row + 1);
-        c = IMG_pixel[ind];
-        
-        #if fastEDDither_remove_artifacts
-        	temp_c = c + (quant_err_c >> 1);	// distribute only half the quantization error to the pixel below
-        #else
-        	temp_c = c + quant_err_c;					// distribute the whole quantization error to the pixel below
-        #endif
-
-        IMG_pixel[ind] = _clamp(temp_c, 0, 255);
-        
-      }
-      
-      // ONLY if fastEDDither_remove_artifacts == true, distribute half of error also at (x + 1, y + 1)
-      #if fastEDDither_remove_artifacts
-      if(col != (_img_width - 1)  &&  row != (_img_height - 1)){
-      	
-        ind = index(col + 1, row + 1);
-        c = IMG_pixel[ind];
-        
-        temp_c = c + (quant_err_c >> 1);
-
-        IMG_pixel[ind] = _clamp(temp_c, 0, 255);
-        
-      }
-	    #endif
+// Flattens one line of the _filters[][] table into (dx, dy, weight) entries, and picks the normalization method once.
+// Normalization of a plan, chosen once: bitshift for powers of 2, else a reciprocal.
+// With 2^k < divisor < 2^(k+1), a (16 + k) bit reciprocal keeps both the product in 32 bits and the result exact.
+static void _planDivisor(_EDFilterTaps &taps, uint8_t divisor){
+	uint8_t k = 0;
+	while((2U << k) <= divisor)  k++;
+	if(is_2s_pow(divisor)){
+		taps.shift = k;
+		taps.recip = 0;
+	}
+	else{
+		taps.shift = 16 + k;
+		taps.recip = ((1UL << taps.shift) + divisor - 1) / divisor;
+	}
+}
 
-    }
-  }
+int8_t Dither::_flattenFilter(uint8_t filter_index, _EDFilterTaps &taps){
+	
+	if(filter_index == CUSTf){
+		if(_custom == NULL)  return -1;		// no custom filter registered
+		taps = *_custom;
+		return 0;
+	}
+	if(filter_index >= filter_types)  return -1;
+	
+	const int8_t *filter = _filters[filter_index];
+	uint8_t divisor = filter[0];
+	int8_t row_offs = 0, col_offs = 1;
+	
+	taps.count = 0;
+	taps.height = 0;
+	taps.width = 0;
+	taps.left = 0;
+	taps.right = 0;
+	
+	for(uint8_t p = 1; filter[p] > END; p++){
+		if(filter[p] < 0){		// linefeed
+			col_offs = filter[p];
+			row_offs++;
+			taps.height++;
+			if(-col_offs > taps.left)  taps.left = -col_offs;
+			continue;
+		}
+		
+		if(filter[p] == 0){		// zero weights only move the cursor (and count as filter height, as in _GPEDDither)
+			taps.height++;
+			col_offs++;
+			continue;
+		}
+		if(taps.height == 0)  taps.width++;
+		
+		taps.dx[taps.count] = col_offs;
+		taps.dy[taps.count] = row_offs;
+		taps.weight[taps.count] = filter[p];
+		taps.count++;
+		if(col_offs > (int8_t)taps.right)  taps.right = col_offs;
+		col_offs++;
+	}
+	
+	_planDivisor(taps, divisor);
+	return 0;
 }
 
 
+// CUSTOM filters: checked, then compiled once into the same plan _flattenFilter builds for the built-in ones.
+// Taps are sorted in memory order (row by row, left to right), so that each pixel updates its neighbours as the built-in kernels do.
+int8_t Dither::setCustomFilter(const DitherTap *taps, uint8_t count, uint8_t divisor){
+	
+	if(taps == NULL  ||  count == 0  ||  count > DITHER_MAX_FILTER_TAPS  ||  divisor == 0)  return -1;
+	
+	_EDFilterTaps plan;
+	plan.count = 0;
+	plan.height = 0;
+	plan.left = 0;
+	plan.right = 0;
+	uint16_t sum = 0;
+	
+	for(uint8_t t = 0; t < count; t++){
+		const DitherTap &tap = taps[t];
+		if(tap.weight == 0  ||  tap.weight > 127)  return -1;		// keeps |err * weight| in the exact range of the normalization
+		if(tap.dy < 0  ||  (tap.dy == 0  &&  tap.dx <= 0))  return -1;		// that neighbour has already been quantized
+		sum += tap.weight;
+		
+		uint8_t p = plan.count;
+		for(; p > 0  &&  (plan.dy[p - 1] > tap.dy  ||  (plan.dy[p - 1] == tap.dy  &&  plan.dx[p - 1] >= tap.dx)); p--){
+			if(plan.dy[p - 1] == tap.dy  &&  plan.dx[p - 1] == tap.dx)  return -1;		// same neighbour twice
+			plan.dx[p] = plan.dx[p - 1];
+			plan.dy[p] = plan.dy[p - 1];
+			plan.weight[p] = plan.weight[p - 1];
+		}
+		plan.dx[p] = tap.dx;
+		plan.dy[p] = tap.dy;
+		plan.weight[p] = tap.weight;
+		plan.count++;
+		
+		if(tap.dy > plan.height)  plan.height = tap.dy;
+		if(-tap.dx > plan.left)  plan.left = -tap.dx;
+		if(tap.dx > plan.right)  plan.right = tap.dx;
+	}
+	if(sum > divisor)  return -1;		// more error than the pixel had: it would build up without bound
+	
+	plan.width = plan.right;		// pixels closer than that to the right edge are only quantized
+	_planDivisor(plan, divisor);
+	
+	if(_custom == NULL  &&  (_custom = (_EDFilterTaps *)malloc(sizeof(_EDFilterTaps))) == NULL)  return -1;		// not enough RAM
+	*_custom = plan;
+	_frame_primed = false;
+	return 0;
+}
 
 
 
-// PATTERNING Classic Algorithms
+// STREAMING Error Diffusion
+// Input rows are never modified: the error is carried in a ring of signed rows instead of being added to 8 bit neighbours, so nothing is cut
+// away on saturated ones. Only the quantization error of each pixel is limited to +-255, to keep the normalization exact.
+// Taps falling outside the row are dropped, so the output is close to, but not the same as, the one of the in-place functions.
 
-void Dither::buildClusteredPattern(){		// fills in the entries of _pattern[][] array using a clustered arrangement. The numbers are ordered "spirally".
-	if(_size < 1)  return;
+int8_t Dither::beginStream(uint32_t width, uint8_t filter_index, uint8_t quantization_bits){
+	
+	endStream();
 	
-	int8_t m = _size, n = _size;
-	int val = 1; 	// starting value
-	uint8_t step = 255 / (_size*_size);
+	if(width == 0  ||  quantization_bits < 1  ||  quantization_bits > 7)  return -1;
+	if(_flattenFilter(filter_index, _stream_taps) < 0)  return -1;
+	
+	_stream_rows = _stream_taps.height + 1;
+	_stream_err = (int16_t *)calloc((size_t)_stream_rows * width, sizeof(int16_t));
+	if(_stream_err == NULL)  return -1;		// not enough RAM
+	
+	_stream_width = width;
+	_stream_head = 0;
+	_stream_quant = quantization_bits;
+	return 0;
+}
 
-	int k = 0, l = 0; 
-		while(k < m && l < n){ 
-		for(int i = l; i < n; ++i)  _pattern[k][i] = step * val++;
-		k++;
+int8_t Dither::ditherRow(const uint8_t *in_row, uint8_t *out_row){
+	
+	if(_stream_err == NULL)  return -1;		// beginStream() has not been called
+	
+	const _EDFilterTaps &taps = _stream_taps;
+	const uint32_t width = _stream_width;
+	const uint8_t *levels = _levelTable(_stream_quant);
+	const uint8_t *transfer = _transfer;
+	const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+	
+	int16_t *curr = _stream_err + (size_t)_stream_head * width;
+	int16_t *dest[DITHER_MAX_FILTER_TAPS];		// error row reached by each tap, already shifted by the tap column
+	for(uint8_t t = 0; t < taps.count; t++){
+		uint8_t r = (_stream_head + taps.dy[t]) % _stream_rows;
+		dest[t] = _stream_err + (size_t)r * width + taps.dx[t];
+	}
+	
+	// Columns [first, last) have all of their taps inside the row
+	const uint32_t first = (taps.left < width)?  taps.left : width;
+	const uint32_t last = (width > (uint32_t)taps.right + first)?  width - taps.right : first;
+	
+	for(uint32_t col = 0; col < width; col++){
+		int16_t v = (transfer?  transfer[in_row[col]] : in_row[col]) + curr[col];
+		uint8_t out = levels[(v < 0)? 0 : (v > 255)? 255 : v];
+		int16_t err = v - (out ^ out_mask);
+		if(err > 255)  err = 255;		// keeps |err * weight| in the exact range of the normalization
+		else if(err < -255)  err = -255;
 		
-		for(int i = k; i < m; ++i)  _pattern[i][n-1] = step * val++;
-		n--;
+		out_row[col] = out;
 		
-		if(k < m){ 
-		  for(int i = n-1; i >= l; --i)  _pattern[m-1][i] = step * val++;
-		  m--;
+		if(col >= first  &&  col < last){
+			for(uint8_t t = 0; t < taps.count; t++){
+				dest[t][col] += _normalizeError(err * taps.weight[t], taps);
+			}
 		}
-		
-		if (l < n){ 
-		  for (int i = m-1; i >= k; --i)  _pattern[i][l] = step * val++;
-		  l++;
+		else{
+			for(uint8_t t = 0; t < taps.count; t++){
+				int64_t x = (int64_t)col + taps.dx[t];
+				if(x >= 0  &&  x < (int64_t)width)  dest[t][col] += _normalizeError(err * taps.weight[t], taps);
+			}
 		}
 	}
+	
+	// The current row becomes the farthest one of the ring
+	memset(curr, 0, (size_t)width * sizeof(int16_t));
+	_stream_head = (_stream_head + 1) % _stream_rows;
+	return 0;
+}
+
+void Dither::endStream(){
+	free(_stream_err);
+	_stream_err = NULL;
+	_stream_width = 0;
 }
 
 
-void Dither::buildBayerPattern(){		// fills in the entries of _pattern[][] array using a dispersed arrangement. The method of choice is a pseudo-Bayer arrangement.
-	if(_size < 1)  return;
+// Fast Error Diffusion Dithering algorithm, as a row-span kernel (same interface as _EDKernel, so it can also run as a wavefront)
+struct _FastEDKernel{
+	uint8_t *img;
+	uint16_t width, height;
+	uint32_t stride;
+	const uint8_t *levels;
+	uint8_t out_mask;
+	uint8_t below, left, right;
+	bool defer;
+	
+	_FastEDKernel(const _DitherCall &call){
+		img = call.img;
+		width = call.width;
+		height = call.height;
+		stride = call.stride;
+		levels = call.levels;
+		out_mask = call.invert_output?  0xFF : 0x00;
+		below = 1;
+		left = 0;
+		right = 1;
+		defer = false;
+	}
 	
-	uint8_t offs = 0, increm = 1;
-	if(!(_size & 0x01)) 	offs = 1;		// size is not a multiple of 2
-	uint8_t step = 255 / (_size*_size);
+	static inline uint8_t clamp(int16_t v){
+		_statsClamp(v);
+		return (v < 0)? 0 : (v > 255)? 255 : v;
+	}
 	
-	for(uint8_t passage = 0; passage < 2; passage++){
-		uint8_t c = 0;
-		c = c + passage;
-		for(uint8_t r = 0; r < _size; r++){
+	template<uint8_t MODE>
+	void span(uint16_t row, uint32_t c0, uint32_t c1, uint8_t *vals){
+		uint8_t *line = img + (uint32_t)row * stride;
+		uint8_t *pix = line + c0;
+		bool bottom = (row == height - 1);
+		
+		for(uint32_t col = c0; col < c1; col++, pix++){
+			uint8_t c = _spanValue<MODE>(line, vals, col);
+			uint8_t out = levels[c];						// 1 bit levels: same as quantize_BW(), inverted if needed
+			int8_t quant_err_c = (c - (out ^ out_mask)) >> 1;
+			
+			*pix = out;
+			_statsError(c - (out ^ out_mask));
+			if(col == (uint32_t)(width - 1))  _statsEdge(quant_err_c);
+			if(bottom)  _statsEdge(quant_err_c);
 			
-			for(; c < _size; c += 2){
-				_pattern[r][c] = step * increm++;
+			// distribute part of error at (x + 1, y)
+			if(col != (uint32_t)(width - 1))  pix[1] = clamp(pix[1] + quant_err_c);
+			
+			// distribute part of error at (x, y + 1)
+			if(!bottom){
+				#if fastEDDither_remove_artifacts
+					pix[stride] = clamp(pix[stride] + (quant_err_c >> 1));		// distribute only half the quantization error to the pixel below
+				#else
+					pix[stride] = clamp(pix[stride] + quant_err_c);						// distribute the whole quantization error to the pixel below
+				#endif
 			}
-			c += offs;
-			c = (_size & 0x01)? (c % _size) : (c & 0x01);
+			
+			// ONLY if fastEDDither_remove_artifacts == true, distribute half of error also at (x + 1, y + 1)
+			#if fastEDDither_remove_artifacts
+			if(col != (uint32_t)(width - 1)  &&  !bottom)  pix[stride + 1] = clamp(pix[stride + 1] + (quant_err_c >> 1));
+			#endif
 		}
-	}	
+	}
+	
+	void run(uint16_t row, uint32_t c0, uint32_t c1){
+		span<_span_run>(row, c0, c1, NULL);
+	}
+	
+	void flush(){}
+	
+	uint32_t syncColumn(){
+		return width;
+	}
+};
+
+void Dither::fastEDDither(uint8_t *IMG_pixel){
+	
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, 1);
+	_statsScope(call, DITHER_FAST_ED);
+	_FastEDKernel kernel(call);
+	call.rowEnter(0);
+	
+	#if DITHER_THREADS
+	uint8_t threads = _workerCount(_threads, _img_height);
+	if(threads > 1  &&  _img_width >= 4 * (uint32_t)(kernel.right + _wavefront_chunk)){
+		_wavefrontRun(kernel, call, kernel.left + kernel.right, kernel.syncColumn(), threads);
+		return;
+	}
+	#endif
+	
+	for(uint16_t row = 0; row < _img_height; row++){
+		call.rowEnter(row + 1);
+		kernel.run(row, 0, _img_width);
+		call.rowDone(row);
+	}
+}
+
+
+
+
+#if DITHER_THREADS
+
+#define _band_min_pixels  32768		// smaller images are not worth the threads
+
+// Point operations (patternDither, randomDither): the rows are split into one band per worker, made of whole pages of 8 rows (as packed by DITHER_OUT_SSD1306)
+template<class ROWS>
+static int8_t _bandRun(const _DitherCall &call, ROWS rows){
+	
+	const uint16_t pages = (call.end_row - call.first_row + 7) / 8;
+	const uint8_t threads = _workerCount(call.threads, pages);
+	if(threads <= 1  ||  (uint32_t)call.width * (call.end_row - call.first_row) < _band_min_pixels)  return rows(call);
+	
+	std::atomic<bool> failed(false);
+	auto worker = [&](uint8_t id){
+		_DitherCall band = call;
+		band.first_row = call.first_row + (uint32_t)pages * id / threads * 8;
+		uint32_t end = call.first_row + (uint32_t)pages * (id + 1) / threads * 8;
+		band.end_row = (end < call.end_row)?  end : call.end_row;
+		if(rows(band) < 0)  failed = true;
+	};
+	
+	std::thread *pool = new std::thread[threads - 1];
+	for(uint8_t t = 1; t < threads; t++)  pool[t - 1] = std::thread(worker, t);
+	worker(0);
+	for(uint8_t t = 1; t < threads; t++)  pool[t - 1].join();
+	delete[] pool;
+	
+	return failed?  -1 : 0;
+}
+
+#endif
+
+
+// PATTERNING Classic Algorithms
+
+// Threshold matrices are generated at runtime, and kept in a cache shared by all Dither objects (see DitherMatrix.cpp)
+int8_t Dither::_useMatrix(uint8_t kind, uint8_t size){
+	if(_matrix  &&  _matrix->kind == kind  &&  _matrix->size == size)  return 0;
+	_DitherMatrix *m = _matrixAcquire(kind, size);
+	if(m == NULL)  return -1;		// size not valid, not enough RAM, or too many users
+	_matrixRelease(_matrix);
+	_matrix = m;
+	_frame_primed = false;
+	return 0;
+}
+
+int8_t Dither::buildClusteredPattern(uint8_t size){		// clustered arrangement: the numbers are ordered "spirally".
+	return _useMatrix(DITHER_MATRIX_CLUSTERED, size);
+}
+
+int8_t Dither::buildBayerPattern(uint8_t size){		// dispersed arrangement: recursive Bayer matrix.
+	return _useMatrix(DITHER_MATRIX_BAYER, size);
+}
+
+int8_t Dither::buildBlueNoisePattern(uint8_t size){		// blue noise texture: as dispersed as a Bayer matrix, but with no visible structure.
+	return _useMatrix(DITHER_MATRIX_BLUE_NOISE, size);
+}
+
+// Converts "transfer[pixel] >= value" (value in [-128 : +382]) into the (thresh, keep) pair used by the row primitives in DitherSIMD.h;
+// with an input transfer, the threshold is mapped through its inverse (see setTransfer), so the pixels themselves need no lookup.
+static inline void _thresholdEntry(int16_t value, uint8_t &thresh, uint8_t &keep, const uint8_t *transfer){
+	if(transfer  &&  value > 0  &&  value <= 255)  value = (value > transfer[255])?  256 : transfer[256 + value];
+	thresh = (value <= 0)?  0 : (value > 255)?  255 : value;
+	keep = (value > 255)?  0x00 : 0xFF;
 }
 
 int8_t Dither::patternDither(uint8_t *IMG_pixel, 
-														 int8_t thresh){			// pixels will be compared to the pattern value offsetted by thresh (in the interval [-128 : +127]) ; by default it's set to 0
+														 int8_t thresh, 			// pixels will be compared to the pattern value offsetted by thresh (in the interval [-128 : +127]) ; by default it's set to 0
+														 uint8_t quantization_bits){
+	if(quantization_bits < 1  ||  quantization_bits > 7)  return -1;
+	if(_matrix == NULL  &&  buildBayerPattern() < 0)  return -1;	// built before the workers start
 	
-	if(_pattern[0][0] == 0)  return -1;	// No pattern has been built. You need to call one of the aforementioned functions, before proceeding.
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, quantization_bits);
+	_statsScope(call, DITHER_PATTERN);
 	
-	uint32_t ind;
-	uint8_t pixel, compa, patt_row;
+	#if DITHER_THREADS
+	return _bandRun(call, [&](const _DitherCall &band){ return _patternRows(band, thresh); });
+	#else
+	return _patternRows(call, thresh);
+	#endif
+}
 
-	for(uint16_t row = 0; row < _img_height; row++){
-		#if is_2s_pow(_size)		// is _size a power of 2 ?
-			patt_row = row & (_size - 1);
-		#else
-			patt_row = row % _size;
-		#endif
+int8_t Dither::_patternRows(const _DitherCall &call, int8_t thresh){
+	
+	if(_matrix == NULL  &&  buildBayerPattern() < 0)  return -1;	// No pattern could be built (not enough RAM)
+	if(call.quantization_bits > 1)  return _patternLevelRows(call, thresh);
+	
+	// Each matrix row is stored already tiled along a chunk of at least _point_chunk pixels, so the image rows are just compared
+	// against a precomputed row, with no modulo operation per pixel. The thresholds only need to be mapped again when they are
+	// offsetted, or when an input transfer is set (one tiled row at a time).
+	const _DitherMatrix &m = *_matrix;
+	const bool mapped = (thresh != 0  ||  _transfer != NULL);
+	uint8_t row_thresh[_max_matrix_tile], row_keep[_max_matrix_tile];
+	if(!mapped)  memset(row_keep, 0xFF, m.tile);
+	
+	const _DitherRowOps &ops = _ditherRowOps();
+	const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+	uint8_t *line = call.img + call.first_row * call.stride;
+	
+	for(uint16_t row = call.first_row; row < call.end_row; row++, line += call.stride){
+		call.rowDecode(row);
+		const uint8_t *tile = m.row(row);
+		if(mapped){
+			for(uint16_t c = 0; c < m.tile; c++)  _thresholdEntry(tile[c] + thresh, row_thresh[c], row_keep[c], _transfer);
+			tile = row_thresh;
+		}
 		
-    for(uint16_t col = 0; col < _img_width; col++){
-    	ind = index(col, row);
-    	pixel = IMG_pixel[ind];
-    	#if is_2s_pow(_size)		// is _size a power of 2 ?
-    		compa = _pattern[patt_row][col & (_size - 1)];		// since modulo operations are very slow on non-math-enhanced uCs, bitwise operations are useful whenever pattern size is a power of 2
-    	#else
-				compa = _pattern[patt_row][col % _size];		// if pattern size is not a power of 2, bitwise modulo calculation cannot be implemented.
-    	#endif
-    	
-    	pixel = (pixel > (compa + thresh))?  0xFF : 0x00;
-      
-      if(_invert_output)	pixel = 0xFF - pixel;
-      IMG_pixel[ind] = pixel;
-    }
-  }
+		for(uint16_t col = 0; col < _img_width; col += m.tile){
+			uint16_t n = (_img_width - col < m.tile)?  _img_width - col : m.tile;
+			ops.compareRow(line + col, line + col, tile, row_keep, n, out_mask);
+		}
+		call.rowDone(row);
+	}
+	return 0;
+}
+
+/*
+	Multi-level ordered dithering: a pixel between two output levels (step = 255 / (2^bits - 1) apart) goes to the upper one when its
+	distance from the lower one reaches the threshold of its matrix cell, scaled to the step. That is, each cell adds an offset
+	d = (255 - t) * step / 255, below one step, and the sum is rounded down to a level: pixels already on a level never move, and with
+	bits = 1 (step 255) this is exactly "v >= t". Offsets are computed once per tiled matrix row, the rest is one row primitive (SIMD).
+	Levels are the same as the quantizer of error diffusion (k * step), so the packed output holds level k.
+*/
+int8_t Dither::_patternLevelRows(const _DitherCall &call, int8_t thresh){
+	
+	const _DitherMatrix &m = *_matrix;
+	const uint8_t step = 255 / ((1 << call.quantization_bits) - 1);
+	uint8_t row_offs[_max_matrix_tile];
+	
+	const _DitherRowOps &ops = _ditherRowOps();
+	const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+	uint8_t *line = call.img + call.first_row * call.stride;
+	
+	for(uint16_t row = call.first_row; row < call.end_row; row++, line += call.stride){
+		call.rowDecode(row);
+		const uint8_t *tile = m.row(row);
+		for(uint16_t c = 0; c < m.tile; c++){
+			int16_t t = tile[c] + thresh;
+			t = (t < 0)?  0 : (t > 255)?  255 : t;
+			row_offs[c] = ((255 - t) * step) / 255;
+		}
+		if(_transfer){
+			for(uint16_t x = 0; x < _img_width; x++)  line[x] = _transfer[line[x]];
+		}
+		
+		for(uint16_t col = 0; col < _img_width; col += m.tile){
+			uint16_t n = (_img_width - col < m.tile)?  _img_width - col : m.tile;
+			ops.levelRow(line + col, line + col, row_offs, n, step, out_mask);
+		}
+		call.rowDone(row);
+	}
 	return 0;
 }
 
@@ -410,37 +1892,74 @@ int8_t Dither::patternDither(uint8_t *IMG_pixel,
 
 // Other dithering Algorithms
 
+/*
+	Counter-based noise: the noise of a pixel is a hash of (x, y, frame, seed), with no state carried from one pixel to the next.
+	Any range of rows (or columns) gives the same values on its own as within a full run, so rows can be split among threads,
+	frames can be dithered again partially (see ditherFrame), and the output only depends on setNoise().
+	The hash is the "lowbias32" integer finalizer by C. Wellons: a row key mixes (y, frame, seed), then each pixel mixes (key, x).
+*/
+static inline uint32_t _noiseMix(uint32_t h){
+	h ^= h >> 16;
+	h *= 0x7FEB352D;
+	h ^= h >> 15;
+	h *= 0x846CA68B;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint32_t _noiseRowKey(uint32_t y, uint32_t frame, uint32_t seed){
+	return _noiseMix(_noiseMix(seed ^ (frame * 0x9E3779B9)) ^ (y * 0x85EBCA6B));
+}
+
+static inline uint8_t _noiseAt(uint32_t row_key, uint32_t x){
+	uint8_t n = _noiseMix(row_key + x * 0xC2B2AE35) >> 24;
+	#if _use_low_amplitude_noise
+		return 64 + (n >> 1);		// low influence noise
+	#else
+		return n;		// high influence noise
+	#endif
+}
+
+
 int8_t Dither::randomDither(uint8_t *IMG_pixel, 
-													bool time_consistency, 		// if time_consistency enabled, a frame of noise will be read from RAM to have all dithered frames time-consistent, and execute faster.
+													bool time_consistency, 		// if time_consistency enabled, every call uses the same noise (as set by setNoise), so that still parts of an animation stay still.
 													int8_t thresh){					 	// pixels will be compared to the random value offsetted by thresh (in the interval [-128 : +127]) ; by default it's set to 0
+  
+  _DitherCall call;
+  _prepareCall(call, IMG_pixel, 1);
+  _statsScope(call, DITHER_RANDOM);
+  
+  #if DITHER_THREADS
+  int8_t res = _bandRun(call, [&](const _DitherCall &band){ return _randomRows(band, thresh); });
+  #else
+  int8_t res = _randomRows(call, thresh);
+  #endif
+  
+  if(!time_consistency)  _noise_frame++;		// next call: new noise
+  return res;
+}
 
-  uint32_t ind;
-  uint8_t pixel, rnd_val;
+int8_t Dither::_randomRows(const _DitherCall &call, int8_t thresh){
   
-  if(time_consistency  &&  is_2s_pow(_rnd_frame_width)){			// Check if the given random_frame_with is really a power of two, before doing disasters with indices...
-  	return -1;
-  }
+  // Noise values are computed chunk by chunk (a loop with no dependency between pixels, which compilers can vectorize), then the whole chunk is compared at once
+  const _DitherRowOps &ops = _ditherRowOps();
+  const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+  uint8_t chunk_noise[_point_chunk], chunk_thresh[_point_chunk], chunk_keep[_point_chunk];
+  uint8_t *line = call.img + call.first_row * call.stride;
   
-  for(uint16_t row = 0; row < _img_height; row++){
-  	uint8_t noise_offs = _rnd_frame[row % _rnd_frame_width];
-    for(uint16_t col = 0; col < _img_width; col++){
-    	
-			ind = index(col, row);
-    	
-    	if(time_consistency){
-				rnd_val = _rnd_frame[noise_offs + (col & (_rnd_frame_width - 1))]; 	// This does the same as "col % _rnd_frame_width", as long as _frame_width is a power of 2
-      }
-			else{
-			  rnd_val = _Rnd();
-			}
+  for(uint16_t row = call.first_row; row < call.end_row; row++, line += call.stride){
+  	const uint32_t row_key = _noiseRowKey(row, _noise_frame, _noise_seed);
+  	call.rowDecode(row);
+  	
+    for(uint16_t col = 0; col < _img_width; col += _point_chunk){
+    	uint16_t n = (_img_width - col < _point_chunk)?  _img_width - col : _point_chunk;
     	
-      pixel = IMG_pixel[ind];
-      
-			pixel = (pixel >= (rnd_val + thresh))?  0xFF : 0x00;
-      
-      if(_invert_output)	pixel = 0xFF - pixel;
-      IMG_pixel[ind] = pixel;
+    	for(uint16_t i = 0; i < n; i++)  chunk_noise[i] = _noiseAt(row_key, col + i);
+    	for(uint16_t i = 0; i < n; i++)  _thresholdEntry(chunk_noise[i] + thresh, chunk_thresh[i], chunk_keep[i], _transfer);
+			
+			ops.compareRow(line + col, line + col, chunk_thresh, chunk_keep, n, out_mask);
     }
+    call.rowDone(row);
   }
   
   return 0;
@@ -455,22 +1974,35 @@ void Dither::thresholding(uint8_t *IMG_pixel, uint8_t thresh){
 	
 	//if(thresh == 128)  return thresholding(IMG_pixel);		// use the faster overloaded implementation - No longer available: performance enhancement was too low.
 	
-	uint32_t ind;
-	uint8_t pixel;
+	_DitherCall call;
+	_prepareCall(call, IMG_pixel, 1);
+	_statsScope(call, DITHER_THRESHOLD);
+	_thresholdRows(call, thresh);
+}
+
+void Dither::_thresholdRows(const _DitherCall &call, uint8_t thresh){
 	
-	for(uint16_t row = 0; row < _img_height; row++){
-    for(uint16_t col = 0; col < _img_width; col++){
-    	
-      ind = index(col, row);
-      pixel = IMG_pixel[ind];
-      
-			if(pixel >= thresh)  pixel = 0xFF;
-			else pixel = 0x00;
-      
-      if(_invert_output)	pixel = 0xFF - pixel;
-      IMG_pixel[ind] = pixel;
-    }
-  }
+	const _DitherRowOps &ops = _ditherRowOps();
+	const uint8_t out_mask = _invert_output?  0xFF : 0x00;
+	uint8_t *line = call.img + call.first_row * call.stride;
+	
+	uint8_t keep;
+	_thresholdEntry(thresh, thresh, keep, _transfer);		// keep == 0: no pixel reaches the threshold
+	
+	// Without packed output (nor source, nor padding between rows), the rows are one contiguous run of pixels, so they go through the row primitive in a single call (SIMD when available).
+	if(!call.sink.buffer  &&  !call.source  &&  call.stride == _img_width){
+		uint32_t n = (uint32_t)_img_width * (call.end_row - call.first_row);
+		if(keep)  ops.thresholdRow(line, line, n, thresh, out_mask);
+		else  memset(line, out_mask, n);
+		return;
+	}
+	
+	for(uint16_t row = call.first_row; row < call.end_row; row++, line += call.stride){
+		call.rowDecode(row);
+		if(keep)  ops.thresholdRow(line, line, _img_width, thresh, out_mask);
+		else  memset(line, out_mask, _img_width);
+		call.rowDone(row);
+	}
 }
 
 /*
@@ -494,6 +2026,386 @@ void Dither::thresholding(uint8_t *IMG_pixel){	// default: assumes thresholding
 }
 */
 
+// FRAME (video) mode
+
+int8_t Dither::dither(uint8_t *IMG_pixel, uint8_t algorithm, uint8_t quantization_bits){
+	switch(algorithm){
+		case DITHER_FS:  return FSDither(IMG_pixel, quantization_bits);
+		case DITHER_JJN:  return JJNDither(IMG_pixel, quantization_bits);
+		case DITHER_STUCKI:  return StuckiDither(IMG_pixel, quantization_bits);
+		case DITHER_BURKES:  return BurkesDither(IMG_pixel, quantization_bits);
+		case DITHER_SIERRA3:  return Sierra3Dither(IMG_pixel, quantization_bits);
+		case DITHER_SIERRA2:  return Sierra2Dither(IMG_pixel, quantization_bits);
+		case DITHER_SIERRA24A:  return Sierra24ADither(IMG_pixel, quantization_bits);
+		case DITHER_ATKINSON:  return AtkinsonDither(IMG_pixel, quantization_bits);
+		case DITHER_PERSONAL:  return PersonalFilterDither(IMG_pixel, quantization_bits);
+		case DITHER_FAST_ED:  fastEDDither(IMG_pixel);  return 0;
+		case DITHER_THRESHOLD:  thresholding(IMG_pixel);  return 0;
+		case DITHER_PATTERN:  return patternDither(IMG_pixel, 0, quantization_bits);
+		case DITHER_RANDOM:  return randomDither(IMG_pixel);
+		case DITHER_CUSTOM:  return CustomFilterDither(IMG_pixel, quantization_bits);
+	}
+	return -1;		// unknown algorithm
+}
+
+// Out of place: the rectangle is dithered as an image of its own, written to dst with its stride, and read from src through a gray source
+// (see setSource), one row at a time, right before the algorithm needs it; when dst is the rectangle itself, it is simply dithered in place.
+int8_t Dither::dither(const uint8_t *src, uint32_t src_stride, uint8_t *dst, uint32_t dst_stride, const DitherRect *roi, uint8_t algorithm, uint8_t quantization_bits){
+	
+	if(src == NULL  ||  dst == NULL)  return -1;
+	DitherRect rect = {0, 0, _img_width, _img_height};
+	if(roi){
+		if((uint32_t)roi->x + roi->width > _img_width  ||  (uint32_t)roi->y + roi->height > _img_height)  return -1;		// rectangle not inside the image
+		rect = *roi;
+	}
+	if(src_stride == 0)  src_stride = _img_width;
+	if(dst_stride == 0)  dst_stride = rect.width;
+	if(rect.width == 0  ||  rect.height == 0  ||  src_stride < _img_width  ||  dst_stride < rect.width)  return -1;
+	
+	const uint8_t *first = src + (uint32_t)rect.y * src_stride + rect.x;
+	_DitherSource view;
+	view.pixels = first;
+	view.format = DITHER_GRAY8;
+	view.stride = src_stride;
+	view.width = view.height = 0;
+	
+	const uint16_t width = _img_width, height = _img_height;
+	_DitherSource *source = _source;
+	_img_width = rect.width;
+	_img_height = rect.height;
+	_img_stride = dst_stride;
+	_source = (first == dst  &&  src_stride == dst_stride)?  NULL : &view;
+	int8_t res = dither(dst, algorithm, quantization_bits);
+	_img_width = width;
+	_img_height = height;
+	_img_stride = 0;
+	_source = source;
+	return res;
+}
+
+
+#define _deviation_block  8		// side of the blocks whose average gray is compared
+
+int8_t Dither::tileDeviation(const uint8_t *IMG_pixel, uint8_t algorithm, uint8_t quantization_bits, DitherDeviation &deviation){
+	
+	if(IMG_pixel == NULL  ||  (algorithm > DITHER_PERSONAL  &&  algorithm != DITHER_CUSTOM)  ||  _tile_size == 0)  return -1;
+	
+	const uint32_t pixels = (uint32_t)_img_width * _img_height;
+	uint8_t *exact = (uint8_t *)malloc(2 * (size_t)pixels);
+	if(exact == NULL)  return -1;
+	uint8_t *tiled = exact + pixels;
+	memcpy(exact, IMG_pixel, pixels);
+	memcpy(tiled, IMG_pixel, pixels);
+	
+	// Neither run writes the packed output, nor reads a source (the copies are the input)
+	uint8_t *out_buffer = _out_buffer;
+	_DitherSource *source = _source;
+	uint16_t tile_size = _tile_size;
+	_out_buffer = NULL;
+	_source = NULL;
+	_tile_size = 0;
+	int8_t res = dither(exact, algorithm, quantization_bits);
+	_tile_size = tile_size;
+	if(res == 0)  res = dither(tiled, algorithm, quantization_bits);
+	_out_buffer = out_buffer;
+	_source = source;
+	
+	memset(&deviation, 0, sizeof(deviation));
+	deviation.pixels = pixels;
+	float tone_sum = 0, seam_sum = 0;
+	uint32_t blocks = 0, seam_blocks = 0;
+	
+	for(uint32_t by = 0; res == 0  &&  by < _img_height; by += _deviation_block){
+		uint32_t bh = (_img_height - by < _deviation_block)?  _img_height - by : _deviation_block;
+		for(uint32_t bx = 0; bx < _img_width; bx += _deviation_block){
+			uint32_t bw = (_img_width - bx < _deviation_block)?  _img_width - bx : _deviation_block;
+			
+			int32_t diff = 0;
+			for(uint32_t y = by; y < by + bh; y++){
+				for(uint32_t x = bx; x < bx + bw; x++){
+					uint32_t i = y * _img_width + x;
+					deviation.differing += (exact[i] != tiled[i]);
+					diff += (int32_t)tiled[i] - exact[i];
+				}
+			}
+			
+			float tone = (float)((diff < 0)?  -diff : diff) / (bw * bh);
+			tone_sum += tone;
+			blocks++;
+			if(tone + 0.5f > deviation.tone_peak)  deviation.tone_peak = tone + 0.5f;
+			if(bx / tile_size != (bx + bw - 1) / tile_size  ||  by / tile_size != (by + bh - 1) / tile_size  ||  (bx > 0  &&  bx % tile_size == 0)  ||  (by > 0  &&  by % tile_size == 0)){
+				seam_sum += tone;
+				seam_blocks++;
+			}
+		}
+	}
+	
+	if(blocks)  deviation.tone_error = tone_sum / blocks;
+	if(seam_blocks)  deviation.seam_error = seam_sum / seam_blocks;
+	free(exact);
+	return res;
+}
+
+/*
+	The frame mode keeps, for every pixel, what is needed to rebuild the last frame without dithering it again:
+	- point operations: the output itself. Only the rows whose source changed are processed; the other ones are copied back.
+	- error diffusion: the value each pixel was quantized from (output and error both derive from it). Processing starts at the first
+	  changed row: the errors that the rows above sent into it are replayed from their recorded values (same order, same clamping), so
+	  the state is exactly the one of a full run. Rows are then processed until, past the last changed row, "filter height" rows in a row
+	  are quantized from the very same values as before: from there on, the error flowing down is the same as in the last frame, and so
+	  is the rest of the output.
+*/
+
+// Dirty rows of the source, from the previous frame or from a list of rectangles
+struct _FrameDirty{
+	const uint8_t *frame, *prev;
+	const DitherRect *rects;
+	uint8_t count;
+	uint16_t width;
+	bool all;
+	
+	bool row(uint16_t r) const{
+		if(all)  return true;
+		if(prev)  return memcmp(frame + (uint32_t)r * width, prev + (uint32_t)r * width, width) != 0;
+		for(uint8_t i = 0; i < count; i++){
+			if(r >= rects[i].y  &&  r - rects[i].y < rects[i].height  &&  rects[i].x < width  &&  rects[i].width > 0)  return true;
+		}
+		return false;
+	}
+};
+
+// Collects the output changes, row by row, into bounding rectangles (rows changing one after the other share a rectangle) and into the XOR diff
+struct _FrameChanges{
+	DitherRect *rects;
+	uint8_t max_rects;
+	int16_t count;
+	int32_t open_row;				// last row of the latest rectangle
+	uint8_t *diff;
+	uint32_t diff_stride;
+	DitherRect scratch;
+	
+	void begin(DitherRect *changed, uint8_t max_changed, uint8_t *diff_buffer, uint16_t width, uint16_t height){
+		rects = (changed  &&  max_changed)?  changed : &scratch;
+		max_rects = (changed  &&  max_changed)?  max_changed : 1;
+		count = 0;
+		open_row = -2;
+		diff = diff_buffer;
+		diff_stride = (width + 7) / 8;
+		if(diff)  memset(diff, 0, diff_stride * height);
+	}
+	
+	void add(uint16_t x0, uint16_t x1, uint16_t r){		// columns [x0, x1] of row r changed
+		DitherRect *last = rects + count - 1;
+		if(count == 0  ||  (r != open_row + 1  &&  count < max_rects)){
+			last = rects + count++;
+			last->x = x0;
+			last->y = r;
+			last->width = x1 - x0 + 1;
+			last->height = 1;
+		}
+		else{		// grow the latest rectangle (also when there is no room for a new one)
+			uint16_t right = last->x + last->width - 1;
+			if(x0 < last->x)  last->x = x0;
+			if(x1 > right)  right = x1;
+			last->width = right - last->x + 1;
+			last->height = r - last->y + 1;
+		}
+		open_row = r;
+	}
+	
+	// before: previous output of the row (through map, if any), after: new output
+	void row(uint16_t r, const uint8_t *before, const uint8_t *after, uint16_t width, const uint8_t *map){
+		int32_t x0 = -1, x1 = -1;
+		uint8_t *bits = diff?  diff + r * diff_stride : NULL;
+		for(uint16_t x = 0; x < width; x++){
+			if((map?  map[before[x]] : before[x]) == after[x])  continue;
+			if(x0 < 0)  x0 = x;
+			x1 = x;
+			if(bits)  bits[x >> 3] |= 0x80 >> (x & 0x07);
+		}
+		if(x0 >= 0)  add(x0, x1, r);
+	}
+};
+
+// Error diffusion rows of one frame; returns the row past the last one processed
+template<class KERNEL>
+static uint16_t _frameRows(KERNEL &kernel, const _DitherCall &call, uint8_t *state, uint16_t first, uint16_t last, _FrameChanges &changes){
+	
+	const uint16_t width = call.width, height = call.height;
+	uint8_t *before = state + (uint32_t)height * width;		// spare row
+	
+	for(uint32_t r = first; r < (uint32_t)first + kernel.below; r++)  call.rowEnter(r);
+	for(uint16_t r = (first > kernel.below)?  first - kernel.below : 0; r < first; r++){
+		kernel.template span<_span_replay>(r, 0, width, state + (uint32_t)r * width);
+	}
+	
+	uint8_t settled = 0;
+	uint16_t row = first;
+	while(row < height){
+		uint8_t *vals = state + (uint32_t)row * width;
+		memcpy(before, vals, width);
+		call.rowEnter(row + kernel.below);
+		kernel.template span<_span_record>(row, 0, width, vals);
+		changes.row(row, before, call.img + (uint32_t)row * width, width, call.levels);
+		
+		settled = (memcmp(before, vals, width) == 0)?  settled + 1 : 0;
+		row++;
+		if(row > last  &&  settled >= kernel.below)  break;
+	}
+	return row;
+}
+
+template<uint8_t DIV, int8_t... C>
+static uint16_t _frameED(const _DitherCall &call, uint8_t *state, uint16_t first, uint16_t last, _FrameChanges &changes){
+	_EDKernel<DIV, C...> kernel(call);
+	return _frameRows(kernel, call, state, first, last, changes);
+}
+
+int8_t Dither::beginFrames(uint8_t algorithm, uint8_t quantization_bits){
+	
+	endFrames();
+	if(algorithm > DITHER_CUSTOM  ||  (algorithm == DITHER_CUSTOM  &&  _custom == NULL))  return -1;
+	if(algorithm >= DITHER_FAST_ED  &&  algorithm <= DITHER_RANDOM  &&  algorithm != DITHER_PATTERN)  quantization_bits = 1;
+	if(quantization_bits < 1  ||  quantization_bits > 7  ||  _img_width == 0  ||  _img_height == 0)  return -1;
+	
+	_frame_state = (uint8_t *)malloc((uint32_t)_img_width * (_img_height + 1));
+	if(_frame_state == NULL)  return -1;		// not enough RAM
+	
+	_frame_width = _img_width;
+	_frame_height = _img_height;
+	_frame_algorithm = algorithm;
+	_frame_quant = quantization_bits;
+	_frame_primed = false;
+	return 0;
+}
+
+void Dither::endFrames(){
+	free(_frame_state);
+	_frame_state = NULL;
+}
+
+int16_t Dither::ditherFrame(uint8_t *frame, const uint8_t *prev_frame, DitherRect *changed, uint8_t max_changed, uint8_t *diff){
+	return _ditherFrame(frame, prev_frame, NULL, 0, changed, max_changed, diff);
+}
+
+int16_t Dither::ditherFrameRects(uint8_t *frame, const DitherRect *dirty, uint8_t dirty_count, DitherRect *changed, uint8_t max_changed, uint8_t *diff){
+	if(dirty == NULL  &&  dirty_count > 0)  return -1;
+	return _ditherFrame(frame, NULL, dirty, dirty_count, changed, max_changed, diff);		// dirty NULL: the whole frame, as with no prev_frame
+}
+
+// Returns the number of rectangles written in "changed" (0: the output did not change), or -1
+int16_t Dither::_ditherFrame(uint8_t *frame, const uint8_t *prev_frame, const DitherRect *dirty, uint8_t dirty_count, DitherRect *changed, uint8_t max_changed, uint8_t *diff){
+	
+	if(_frame_state == NULL  ||  frame == NULL)  return -1;		// beginFrames() has not been called
+	if(_frame_width != _img_width  ||  _frame_height != _img_height)  return -1;		// dimensions changed since beginFrames()
+	
+	const uint16_t width = _img_width, height = _img_height;
+	_DitherCall call;
+	_prepareCall(call, frame, _frame_quant);
+	call.source = NULL;		// frames are their own input (see setSource)
+	_statsScope(call, _frame_algorithm);
+	const _PackedSink sink = call.sink;
+	call.sink.buffer = NULL;		// rows are packed at the end, only if their output changed
+	
+	_FrameDirty dirty_rows = {frame, prev_frame, dirty, dirty_count, width, !_frame_primed  ||  (prev_frame == NULL  &&  dirty == NULL)};
+	_FrameChanges changes;
+	changes.begin(changed, max_changed, diff, width, height);
+	uint8_t *state = _frame_state;
+	
+	if(_frame_algorithm <= DITHER_FAST_ED  ||  _frame_algorithm == DITHER_CUSTOM){
+		uint16_t first = 0, last = height;
+		while(first < height  &&  !dirty_rows.row(first))  first++;
+		if(first < height){
+			last = height - 1;
+			while(!dirty_rows.row(last))  last--;
+		}
+		
+		uint16_t end = first;
+		if(first < height){
+			switch(_frame_algorithm){
+				case DITHER_FS:  end = _frameED<FSf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_JJN:  end = _frameED<JJNf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_STUCKI:  end = _frameED<STUf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_BURKES:  end = _frameED<BURf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_SIERRA3:  end = _frameED<SIE3f_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_SIERRA2:  end = _frameED<SIE2f_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_SIERRA24A:  end = _frameED<SIE24f_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_ATKINSON:  end = _frameED<ATKf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_PERSONAL:  end = _frameED<PERf_coeffs>(call, state, first, last, changes);  break;
+				case DITHER_CUSTOM:{
+					if(call.plan->recip){
+						_PlanKernel<false> kernel(call);
+						end = _frameRows(kernel, call, state, first, last, changes);
+					}
+					else{
+						_PlanKernel<true> kernel(call);
+						end = _frameRows(kernel, call, state, first, last, changes);
+					}
+					break;
+				}
+				default:{
+					_FastEDKernel kernel(call);
+					end = _frameRows(kernel, call, state, first, last, changes);
+				}
+			}
+		}
+		
+		// Rows not processed again are rebuilt from their recorded values
+		for(uint32_t p = 0; p < (uint32_t)first * width; p++)  frame[p] = call.levels[state[p]];
+		for(uint32_t p = (uint32_t)end * width; p < (uint32_t)height * width; p++)  frame[p] = call.levels[state[p]];
+	}
+	else{
+		uint16_t row = 0;
+		while(row < height){
+			uint8_t *line = frame + (uint32_t)row * width, *prev_out = state + (uint32_t)row * width;
+			if(!dirty_rows.row(row)){
+				memcpy(line, prev_out, width);
+				row++;
+				continue;
+			}
+			
+			// Runs of dirty rows are processed at once
+			uint16_t end = row + 1;
+			while(end < height  &&  dirty_rows.row(end))  end++;
+			call.first_row = row;
+			call.end_row = end;
+			if(_frame_algorithm == DITHER_THRESHOLD)  _thresholdRows(call, 128);
+			else if(_frame_algorithm == DITHER_RANDOM)  _randomRows(call, 0);		// time consistent: the noise of a pixel is the same at every frame
+			else if(_patternRows(call, 0) < 0)  return -1;
+			
+			for(; row < end; row++, line += width, prev_out += width){
+				changes.row(row, prev_out, line, width, NULL);
+				memcpy(prev_out, line, width);
+			}
+		}
+	}
+	
+	if(!_frame_primed){		// nothing to compare the first frame with: all of it has changed
+		changes.begin(changed, max_changed, diff, width, height);
+		changes.add(0, width - 1, 0);
+		changes.rects[0].height = height;
+		if(diff)  memset(diff, 0xFF, changes.diff_stride * height);
+		_frame_primed = true;
+	}
+	
+	// Packed output: only the rows inside the changed rectangles (whole pages, for DITHER_OUT_SSD1306) are packed again
+	if(sink.buffer){
+		for(int16_t i = 0; i < changes.count; i++){
+			uint16_t r = changes.rects[i].y, r_end = r + changes.rects[i].height;
+			if(sink.format == DITHER_OUT_SSD1306){
+				r &= ~0x07;
+				r_end = (r_end + 7) & ~0x07;
+				if(r_end > height)  r_end = height;
+			}
+			for(; r < r_end; r++)  sink.row(frame, width, height, r, width);
+		}
+	}
+	
+	return (changed  &&  max_changed)?  changes.count : (changes.count > 0);
+}
+
+
+
 uint32_t Dither::index(int x, int y){		// ONLY for byte-aligned pixels (so monochrome or, generally speaking, single-byte color such as RGB332 format)
   return (x) + (y) * _img_width;
 }
@@ -504,16 +2416,6 @@ uint32_t Dither::index(int x, int y, uint8_t pix_len){			// Generic indexing fun
 }
 
 
-uint8_t Dither::_Rnd(uint8_t seed) {
-  static uint8_t y = 1;
-  y += y * micros() * millis() + seed;
-  #if _use_low_amplitude_noise
-  	return 64 + (y >> 1);		// low influence noise
-	#else
-		return y;		// high influence noise
-	#endif
-}
-
 uint8_t Dither::_twos_power(uint16_t number){		// returns the position of the highest (MS) '1' in a power of 2 number
 	uint8_t l2 = 0;
 	while(number >>= 1){
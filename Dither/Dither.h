@@ -29,23 +29,249 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ********************************************************************************/
 
-#if (ARDUINO >= 100)
+// Outside of the Arduino IDE (e.g. on a PC) the library only needs the standard C headers
+#if defined(ARDUINO)  &&  (ARDUINO >= 100)
   #include "Arduino.h"
-#else
+#elif defined(ARDUINO)
   #include "WProgram.h"
+#else
+  #include <stdint.h>
+  #include <stddef.h>
+  #include <stdlib.h>
+  #include <string.h>
+#endif
+
+// Multi-core support (wavefront error diffusion). Enabled by default on hosts and ESP32; define DITHER_THREADS as 0 before including this file to leave it out.
+#ifndef DITHER_THREADS
+  #if !defined(ARDUINO) || defined(ESP32)
+    #define DITHER_THREADS  1
+  #else
+    #define DITHER_THREADS  0
+  #endif
+#endif
+
+// Packed output formats (see setOutput)
+#define DITHER_OUT_BYTES     0		// no packed output: one byte per pixel, in place (default)
+#define DITHER_OUT_1BPP      1		// 1 bit per pixel, row-major, MSB first (leftmost pixel); stride: bytes per row, (width + 7) / 8 by default
+#define DITHER_OUT_SSD1306   2		// 1 bit per pixel, in pages of 8 rows (LSB on top) as in SSD1306/SH1106 RAM; stride: bytes per page, width by default
+#define DITHER_OUT_2BPP      3		// 2 bits per pixel, row-major, leftmost pixel in the 2 MSBs; stride: bytes per row, (width + 3) / 4 by default
+#define DITHER_OUT_4BPP      4		// 4 bits per pixel, row-major, leftmost pixel in the high nibble; stride: bytes per row, (width + 1) / 2 by default
+#define DITHER_OUT_BITPLANES 5		// one 1 bpp plane (as DITHER_OUT_1BPP) per quantization bit, plane 0 holding the LSB of each gray level; planes are stride * height bytes apart
+#define DITHER_OUT_PBM       6		// as DITHER_OUT_1BPP, but with 1 for black, as in PBM files (see ditherFile); padding bits are 0
+
+// Color formats and built-in palettes (see colorDither); the formats are also source formats (see setSource)
+#define DITHER_RGB888        0		// 3 bytes per pixel: R, G, B
+#define DITHER_RGB565        1		// 2 bytes per pixel: one uint16_t, in the CPU byte order (as Adafruit_GFX buffers)
+#define DITHER_RGB332        2		// 1 byte per pixel: 3 bits red, 3 bits green, 2 bits blue (setSource only)
+#define DITHER_MONO1         3		// 1 bit per pixel, row-major, MSB first, 1 for white, as DITHER_OUT_1BPP (setSource only)
+#define DITHER_GRAY8         4		// 1 byte per pixel, already gray (setSource only)
+#define DITHER_PAL_RGB332    0		// 256 colors: 3 bits red, 3 bits green, 2 bits blue
+#define DITHER_PAL_EINK6     1		// black, white, red, green, blue, yellow (6 color e-paper panels)
+#define DITHER_PAL_EGA16     2		// the 16 EGA/CGA colors
+
+// Luma of the color sources (see setSource)
+#define DITHER_LUMA_AVERAGE  0		// (R + G + B) / 3, as color888ToGray256
+#define DITHER_LUMA_REC601   1		// 0.299 R + 0.587 G + 0.114 B (SD video, JPEG)
+#define DITHER_LUMA_REC709   2		// 0.2126 R + 0.7152 G + 0.0722 B (HD video, sRGB)
+
+// Resampling of a source of another size (see setSourceSize)
+#define DITHER_RESAMPLE_AREA     0		// mean of the source pixels covered by each output pixel (downscaling; nearest pixel when upscaling)
+#define DITHER_RESAMPLE_BILINEAR 1		// interpolation of the 4 source pixels around each output pixel center (upscaling)
+
+// Resolution (bits per channel) of the nearest-color lookup table: (2^bits)^3 bytes of RAM. Each cell holds the palette entry nearest to its center;
+// with palettes of up to DITHER_COLOR_EXACT colors, the cells where another entry is nearer to some of the pixels are marked (1 bit per cell)
+// and searched pixel by pixel, so the color is always the nearest one. With larger palettes, pixels near the edge of such a cell may get a
+// color slightly farther than the nearest one (by less than the size of a cell): more bits make the cells, and the error, smaller.
+#ifndef DITHER_COLOR_LUT_BITS
+  #if defined(ARDUINO)  &&  !defined(ESP32)
+    #define DITHER_COLOR_LUT_BITS  4
+  #else
+    #define DITHER_COLOR_LUT_BITS  5
+  #endif
+#endif
+#ifndef DITHER_COLOR_EXACT
+  #define DITHER_COLOR_EXACT  16
+#endif
+
+// Ordered dithering matrices (see buildBayerPattern, buildClusteredPattern)
+#define DITHER_MATRIX_BAYER      0		// dispersed dots (recursive Bayer matrix); sizes: powers of 2
+#define DITHER_MATRIX_CLUSTERED  1		// clustered dots (spiral matrix); any size
+#define DITHER_MATRIX_BLUE_NOISE 2		// blue noise texture (void-and-cluster); any size from 4
+#ifndef DITHER_PATTERN_SIZE				// size used when patternDither is called before any matrix has been built
+  #if defined(ARDUINO)  &&  !defined(ESP32)
+    #define DITHER_PATTERN_SIZE  4
+  #else
+    #define DITHER_PATTERN_SIZE  8
+  #endif
+#endif
+#ifndef DITHER_MAX_PATTERN_SIZE
+  #define DITHER_MAX_PATTERN_SIZE  64
+#endif
+#ifndef DITHER_NOISE_SIZE				// default blue noise texture size
+  #if defined(ARDUINO)  &&  !defined(ESP32)
+    #define DITHER_NOISE_SIZE  16
+  #else
+    #define DITHER_NOISE_SIZE  64
+  #endif
+#endif
+#ifndef DITHER_MAX_NOISE_SIZE
+  #define DITHER_MAX_NOISE_SIZE  128
 #endif
 
+// Most taps (weights) of an error diffusion filter, custom ones included (see setCustomFilter); the built-in filters need 12
+#ifndef DITHER_MAX_FILTER_TAPS
+  #if defined(ARDUINO)  &&  !defined(ESP32)
+    #define DITHER_MAX_FILTER_TAPS  16
+  #else
+    #define DITHER_MAX_FILTER_TAPS  48
+  #endif
+#endif
+
+// Loading and saving threshold matrices as PGM files (stdio). Enabled by default on hosts only.
+#ifndef DITHER_FILE_IO
+  #if defined(ARDUINO)
+    #define DITHER_FILE_IO  0
+  #else
+    #define DITHER_FILE_IO  1
+  #endif
+#endif
+
+// Instrumentation (see setStats): statistics of each call, gathered inside the error diffusion loops. Off by default: the hooks then generate
+// no code at all. To enable it, define DITHER_STATS as 1 for the library sources too (e.g. -DDITHER_STATS=1 among the compiler flags).
+#ifndef DITHER_STATS
+  #define DITHER_STATS  0
+#endif
+
+// Algorithms, for dither() and the frame mode
+#define DITHER_FS          0		// FSDither; the error diffusion ones have the same numbers as their filters (FSf ... PERf)
+#define DITHER_JJN         1
+#define DITHER_STUCKI      2
+#define DITHER_BURKES      3
+#define DITHER_SIERRA3     4
+#define DITHER_SIERRA2     5
+#define DITHER_SIERRA24A   6
+#define DITHER_ATKINSON    7
+#define DITHER_PERSONAL    8
+#define DITHER_FAST_ED     9		// fastEDDither
+#define DITHER_THRESHOLD   10		// thresholding, at 128
+#define DITHER_PATTERN     11		// patternDither, with the matrix in use
+#define DITHER_RANDOM      12		// randomDither
+#define DITHER_CUSTOM      13		// CustomFilterDither, with the filter registered by setCustomFilter (not available to ditherBatch jobs)
+
+// Latency budget (auto) mode preferences (see setBudget): share of the budget the chosen algorithm may take
+#define DITHER_PREFER_QUALITY   0		// all of it: the best algorithm that fits
+#define DITHER_PREFER_BALANCED  1		// 3/4, leaving time to draw and send the frame
+#define DITHER_PREFER_SPEED     2		// 1/2
+#define DITHER_AUTO_CANDIDATES  12		// algorithms the auto mode chooses from (see README)
+
+// One weight of a custom error diffusion filter (see setCustomFilter): the neighbour at (dx, dy) from the pixel being quantized gets
+// weight / divisor of its error. Neighbours must not be processed yet: dy > 0, or dy == 0 and dx > 0.
+struct DitherTap{
+	int8_t dx, dy;
+	uint8_t weight;		// 1 to 127
+};
+
+// Rectangle of pixels, e.g. a region of a frame that has changed (see ditherFrame)
+struct DitherRect{
+	uint16_t x, y;
+	uint16_t width, height;
+};
+
+// One image of a batch (see ditherBatch): set the input fields, the others are filled in when the job has run
+struct DitherJob{
+	uint8_t *buffer = NULL;					// 256 shades of gray per pixel, dithered in place
+	uint16_t width = 0, height = 0;
+	uint8_t algorithm = DITHER_FS;	// one of the DITHER_... algorithms (see dither)
+	uint8_t quantization_bits = 1;
+	bool invert_output = false;
+	float gamma = 1.0;							// input correction (see setTransfer)
+	int8_t contrast = 0, brightness = 0;
+	uint8_t *output = NULL;					// packed output (see setOutput); NULL: none
+	uint8_t output_format = DITHER_OUT_1BPP;
+	uint32_t output_stride = 0;
+	
+	int8_t status = -1;							// result: 0 when done, -1 on error (not valid parameters, not enough RAM)
+	uint32_t time_us = 0;						// result: time spent on the job, in microseconds
+};
+
+// Statistics of one call (see setStats). Error figures are only gathered by error diffusion (fastEDDither included).
+struct DitherStats{
+	uint8_t algorithm;				// DITHER_... algorithm of the call
+	uint32_t time_us;					// wall time of the call, in microseconds
+	uint32_t pixels;					// pixels processed
+	uint32_t clamped;					// neighbour updates clamped to [0 : 255]
+	uint32_t clamped_error;		// error cut away by those clamps (saturation), summed over all of them
+	uint64_t error_sum;				// |quantization error| summed over all pixels: mean = error_sum / pixels
+	uint8_t error_peak;				// largest |quantization error|
+	uint32_t edge_error;			// |error| that could not be diffused, since its taps fell outside the image (borders)
+};
+typedef void (*DitherStatsCallback)(const DitherStats &stats);
+
+// How far the tiled error diffusion is from the exact one (see tileDeviation). Tone figures compare the average gray of 8x8 blocks,
+// which is what the eye sees: two dithered images can differ in many pixels and still look the same.
+struct DitherDeviation{
+	uint32_t pixels;					// pixels compared
+	uint32_t differing;				// pixels with a different output
+	float tone_error;					// mean |difference| of the block averages, in gray levels [0 : 255]
+	uint8_t tone_peak;				// largest of those differences
+	float seam_error;					// as tone_error, over the blocks on a tile seam only
+};
+
+// Cost of each candidate of the auto mode, measured on this target (see calibrate). It can be saved (e.g. to EEPROM or a file) and given
+// back with setCalibration() at the next start, to skip the calibration run; it is only valid for the same image size and settings.
+struct DitherCalibration{
+	uint16_t width, height;
+	uint8_t threads;									// setThreads() value
+	uint16_t tile_size;								// setTiles() value
+	uint8_t quantization_bits;				// max_bits of setBudget()
+	uint32_t cost_us[DITHER_AUTO_CANDIDATES];		// whole image, in microseconds, from the best quality candidate to the cheapest
+};
+
+struct _DitherCall;
+struct _DitherMatrix;
+struct _DitherSource;
+struct _DitherAuto;
+
+// Flattened filter (one entry per weight), used by the row-based error diffusion paths and by custom filters (compiled once, see setCustomFilter)
+struct _EDFilterTaps{
+	int8_t dx[DITHER_MAX_FILTER_TAPS], dy[DITHER_MAX_FILTER_TAPS], weight[DITHER_MAX_FILTER_TAPS];
+	uint8_t count;
+	uint8_t height, width;		// rows below the pivot, and columns on its right whose pixels keep their taps inside the row (built-in filters: as _GPEDDither derives them)
+	uint8_t left, right;			// columns reached on the left and on the right of the pivot pixel
+	uint8_t shift;						// normalization: (err * weight) >> shift if recip == 0 ...
+	uint32_t recip;						// ... else ((err * weight) * recip) >> shift, which equals the integer division for |err * weight| < 32768
+};
+static inline int16_t _normalizeError(int16_t num, const _EDFilterTaps &taps){
+	if(!taps.recip)  return num >> taps.shift;
+	return (num >= 0)?  (int16_t)(((uint32_t)num * taps.recip) >> taps.shift) : -(int16_t)(((uint32_t)(-num) * taps.recip) >> taps.shift);
+}
+
 #define END (-32)
 #define is_2s_pow(number)  !((number) & ((number) - 1))
 
 class Dither {
  public:
   Dither(uint16_t width = 0, uint16_t height = 0, bool invert_output = false);
+  ~Dither();
   
   void updateDimensions(uint16_t new_width, uint16_t new_height);
 	uint16_t getWidth();
 	uint16_t getHeight();
-	void reRandomizeBuffer();
+	void reRandomizeBuffer();		// moves randomDither to another noise pattern (a new seed, derived from the current one)
+	void setNoise(uint32_t seed, uint32_t frame = 0);		// randomDither noise: the value of each pixel is a function of (x, y, frame, seed) only
+	void setOutput(uint8_t *buffer, uint8_t format = DITHER_OUT_1BPP, uint32_t stride = 0);		// every algorithm will also write its output, packed, into buffer (NULL disables it)
+	uint32_t outputSize(uint8_t format = DITHER_OUT_1BPP, uint32_t stride = 0, uint8_t quantization_bits = 1);		// bytes of a setOutput() buffer for the image size (DITHER_OUT_BYTES: of the image itself)
+	int8_t setSource(const void *pixels, uint8_t format = DITHER_RGB565, uint8_t luma = DITHER_LUMA_AVERAGE, uint32_t stride = 0);		// every algorithm will read its input from pixels, decoding each row right before dithering it, and only write its output to IMG_pixel (NULL disables it). Not used by the frame, streaming and color functions.
+	int8_t setSourceSize(uint16_t width, uint16_t height, uint8_t resample = DITHER_RESAMPLE_AREA);		// size of the setSource() pixels, when it is not the image size: each output row is resampled from them while dithering. 0, 0: the image size (default). Kept until setSource(NULL).
+	void setThreads(uint8_t threads);		// error diffusion and randomDither workers: 1 (default) runs serially, 0 uses one per core. Output does not depend on this value. Needs DITHER_THREADS.
+	int8_t setTransfer(float gamma = 1.0, int8_t contrast = 0, int8_t brightness = 0);		// input correction applied by every algorithm on the fly: out = 255 * (in / 255)^gamma, then contrast and brightness (see README). Default values disable it.
+	int8_t setStats(DitherStats *stats, DitherStatsCallback callback = NULL);		// every call fills stats (if not NULL), then calls callback (if not NULL). Returns -1 without DITHER_STATS.
+	
+	// Tiled error diffusion (approximate): the error diffusion functions split the image into tile_size x tile_size tiles, dithered independently
+	// (one per setThreads() worker at a time), each one warmed up on "margin" rows and columns of its neighbours; seam_noise also perturbs the
+	// start of every warm-up, so that the tiles do not all start in the same phase. tile_size = 0 (default) restores the exact output.
+	int8_t setTiles(uint16_t tile_size, uint8_t margin = 16, bool seam_noise = false);
+	int8_t tileDeviation(const uint8_t *IMG_pixel, uint8_t algorithm, uint8_t quantization_bits, DitherDeviation &deviation);		// dithers a copy of the image both ways (algorithm: DITHER_FS ... DITHER_PERSONAL, or DITHER_CUSTOM) and compares them; IMG_pixel is left untouched
  	
   int8_t FSDither(uint8_t *IMG_pixel, uint8_t quant_bits = 1);
   int8_t JJNDither(uint8_t *IMG_pixel, uint8_t quant_bits = 1);
@@ -56,15 +282,67 @@ class Dither {
 	int8_t Sierra24ADither(uint8_t *IMG_pixel, uint8_t quantization_bits = 1);
 	int8_t AtkinsonDither(uint8_t *IMG_pixel, uint8_t quantization_bits = 1);
 	int8_t PersonalFilterDither(uint8_t *IMG_pixel, uint8_t quantization_bits = 1);
+	
+	// Custom error diffusion filter: checked and compiled once (flattened offsets, edge bounds, bitshift or reciprocal normalization), then run
+	// by CustomFilterDither, dither(DITHER_CUSTOM) and the frame mode, and as filter CUSTf by the streaming and color functions.
+	// count: up to DITHER_MAX_FILTER_TAPS; the weights may add up to divisor at most. Registering another filter replaces it.
+	int8_t setCustomFilter(const DitherTap *taps, uint8_t count, uint8_t divisor);
+	int8_t CustomFilterDither(uint8_t *IMG_pixel, uint8_t quantization_bits = 1);
+  
+  // Streaming (scanline) error diffusion: rows are pushed one at a time, only (filter height + 1) rows of signed error are kept in RAM.
+  int8_t beginStream(uint32_t width, uint8_t filter_index = 0, uint8_t quantization_bits = 1);		// filter_index is one of FSf (0), JJNf, ..., PERf, or CUSTf
+  int8_t ditherRow(const uint8_t *in_row, uint8_t *out_row);		// in_row and out_row may be the same buffer; Time complexity is O(width) per row.
+  void endStream();
+  
+  // Color error diffusion: R, G and B errors are carried together, and each pixel is replaced by the nearest color of the palette (from a
+  // lookup table: exact with up to DITHER_COLOR_EXACT colors, approximate beyond; see DITHER_COLOR_LUT_BITS).
+  int8_t setPalette(uint8_t builtin_palette);														// DITHER_PAL_RGB332, DITHER_PAL_EINK6 or DITHER_PAL_EGA16
+  int8_t setPalette(const uint8_t *rgb888, uint16_t count);						// custom palette: count (up to 256) R, G, B triplets; the array is copied
+  int8_t colorDither(uint8_t *IMG_pixel, uint8_t pixel_format = DITHER_RGB888, uint8_t filter_index = 0, uint8_t *palette_indices = NULL);	// palette_indices (optional): one byte per pixel
+  
+  int8_t dither(uint8_t *IMG_pixel, uint8_t algorithm = DITHER_FS, uint8_t quantization_bits = 1);		// runs one of the DITHER_... algorithms, with its default parameters
+  // Out of place: dithers the roi rectangle (NULL: the whole getWidth() x getHeight() image) of src, which is only read, into dst (roi->width x roi->height
+  // pixels, from its first byte). Strides are bytes per row; 0: getWidth() for src, the rectangle width for dst. dst may be the rectangle of src itself
+  // (same stride), which is then dithered in place; any other overlap is not allowed. The packed output (see setOutput) covers the rectangle.
+  int8_t dither(const uint8_t *src, uint32_t src_stride, uint8_t *dst, uint32_t dst_stride, const DitherRect *roi = NULL, uint8_t algorithm = DITHER_FS, uint8_t quantization_bits = 1);
+  
+  // Frame (video) mode: only the rows that changed since the previous frame are dithered again (for error diffusion: from the first changed
+  // row down to where the output settles back to the previous one); the output is the same as dithering every frame in full.
+  int8_t beginFrames(uint8_t algorithm = DITHER_FS, uint8_t quantization_bits = 1);		// keeps width * (height + 1) bytes of state
+  int16_t ditherFrame(uint8_t *frame, const uint8_t *prev_frame, DitherRect *changed = NULL, uint8_t max_changed = 0, uint8_t *diff = NULL);	// prev_frame: previous source frame (NULL: dither it all)
+  int16_t ditherFrameRects(uint8_t *frame, const DitherRect *dirty, uint8_t dirty_count, DitherRect *changed = NULL, uint8_t max_changed = 0, uint8_t *diff = NULL);	// dirty: regions of the source that changed (NULL: dither it all; dirty_count 0: none)
+  void endFrames();
+  
+  // Latency budget (auto) mode: ditherAuto() runs the best DITHER_... algorithm whose cost fits budget_us per frame. Costs are measured once
+  // on this target (see calibrate), then corrected by the time each frame actually takes: frames over the budget make it step down to a cheaper
+  // algorithm, and a lasting margin lets it step back up. max_bits: quantization bits of the display (1-bit only algorithms use 1). 0 disables it.
+  int8_t setBudget(uint32_t budget_us, uint8_t preference = DITHER_PREFER_QUALITY, uint8_t max_bits = 1);
+  int8_t calibrate(const uint8_t *sample = NULL);		// times every candidate on a band of rows of sample (getWidth() x getHeight(), left untouched; NULL: a gray ramp). Run by ditherAuto() when needed.
+  int8_t ditherAuto(uint8_t *IMG_pixel);					// returns the DITHER_... algorithm it ran, or -1
+  int8_t getAutoChoice(uint8_t &algorithm, uint8_t &quantization_bits);		// what the next ditherAuto() will run
+  int8_t getCalibration(DitherCalibration &calibration);
+  int8_t setCalibration(const DitherCalibration &calibration);		// after setBudget(); -1 if it does not match the image size and settings
   
   void fastEDDither(uint8_t *IMG_pixel);				 	// Time complexity is O(3n), but also optimized for faster calculations and array accesses (especially on low-end uCs).
   #define fastEDDither_remove_artifacts  false		// making this true will make the above algorithm O(4n), but will reduce artifacts visible when images are bigger than roughly 8000 pixels (x*y).
   
-  void buildClusteredPattern();		// Time complexity is O(1).
-  void buildBayerPattern();		// Time complexity is O(1).
-  int8_t patternDither(uint8_t *IMG_pixel, int8_t thresh = 0);		// Time complexity is O(n).
+  int8_t buildClusteredPattern(uint8_t size = DITHER_PATTERN_SIZE);		// size in [2 : DITHER_MAX_PATTERN_SIZE]; gives size^2 + 1 gray shades (up to 256). Matrices are shared by all Dither objects, and built only once.
+  int8_t buildBayerPattern(uint8_t size = DITHER_PATTERN_SIZE);				// size: a power of 2 in [2 : DITHER_MAX_PATTERN_SIZE]
+  int8_t buildBlueNoisePattern(uint8_t size = DITHER_NOISE_SIZE);		// size in [4 : DITHER_MAX_NOISE_SIZE]; near error diffusion quality at thresholding speed. Generation is slow (about 1s for 128x128 on a PC), but done only once.
+  #if DITHER_FILE_IO
+  int8_t loadPattern(const char *pgm_path);		// square binary PGM (P5), 2x2 to 128x128: a pixel is set when it is > the matrix value
+  int8_t savePattern(const char *pgm_path);		// saves the matrix in use, in the same format
+  #endif
   
-  int8_t randomDither(uint8_t *IMG_pixel, bool time_consistency = true, int8_t thresh = 0);	  // time-consistency enabled by default (faster speed); 	Time complexity is O(n).
+  #if DITHER_FILE_IO
+  // File pipeline: a binary PGM (8 or 16 bit, up to 2^32 - 1 pixels per side) is dithered row by row with the streaming error diffusion,
+  // and written as it goes, so memory stays bounded whatever the image size. out_format: DITHER_OUT_PBM (P4 file), DITHER_OUT_BYTES (P5 file),
+  // or raw packed rows with no header: DITHER_OUT_1BPP, DITHER_OUT_2BPP or DITHER_OUT_4BPP.
+  int8_t ditherFile(const char *pgm_path, const char *out_path, uint8_t filter_index = 0, uint8_t out_format = DITHER_OUT_PBM, uint8_t quantization_bits = 1);
+  #endif
+  int8_t patternDither(uint8_t *IMG_pixel, int8_t thresh = 0, uint8_t quantization_bits = 1);		// Time complexity is O(n). Uses a Bayer matrix of DITHER_PATTERN_SIZE if none has been built. quantization_bits > 1: ordered dithering between adjacent gray levels. Rows are split among the setThreads() workers.
+  
+  int8_t randomDither(uint8_t *IMG_pixel, bool time_consistency = true, int8_t thresh = 0);	  // time-consistency (same noise at every call) enabled by default; 	Time complexity is O(n). Rows are split among the setThreads() workers.
   
   void thresholding(uint8_t *IMG_pixel, uint8_t thresh = 128);	// Time complexity is Theta(n).
   // void thresholding(uint8_t *IMG_pixel);										// Overloaded function - No longer implemented
@@ -89,22 +367,56 @@ class Dither {
   
 private:
   uint16_t _img_width, _img_height;
+  uint32_t _img_stride = 0;				// bytes per row of the image, during an out of place dither() (0: the width)
   bool _invert_output;
+  uint8_t _threads;
+  
+  // Packed output
+  uint8_t *_out_buffer;
+  uint8_t _out_format;
+  uint32_t _out_stride;
+  void _prepareCall(_DitherCall &call, uint8_t *IMG_pixel, uint8_t quantization_bits);
+  _DitherSource *_source = NULL;		// see setSource; NULL: the input is IMG_pixel itself
+  uint32_t _outStride(uint8_t format, uint32_t stride);		// stride, or the default one of the format
+  static void _packRow(const uint8_t *src, uint8_t *dst, uint32_t width, uint8_t format);		// one row, in a row-major packed format
+  DitherStats *_stats = NULL;
+  DitherStatsCallback _stats_callback = NULL;
+  uint16_t _tile_size = 0;				// see setTiles; 0: exact error diffusion
+  uint8_t _tile_margin = 16;
+  bool _tile_noise = false;
+  
+  // Per-pixel tables, built once per configuration
+  uint8_t _levels[256];						// output of the quantizer for each input value, inversion included
+  uint8_t _levels_bits = 0;				// quantization bits _levels[] has been built for (0: not built yet)
+  bool _levels_inverted;
+  const uint8_t *_levelTable(uint8_t quantization_bits);
+  uint8_t *_transfer = NULL;			// input transfer (gamma, contrast, brightness): 256 entries, followed by 256 entries of its inverse (NULL: identity)
   
   // For Error Distribution algorithms
   int8_t _GPEDDither(uint8_t *IMG_pixel, uint8_t quantization_bits, uint8_t filter_index);	// GPED (dithering) : General Purpose Error Distribution (dithering)
+  friend struct _DitherReference;		// host check of the kernels against _GPEDDither (extras/benchmark, --check)
   #define max_filter_entries 16			// Max filter entries per line; this parameter is needed due to limitations in C++, that cannot recognize on its own when a line ends.
   #define filter_types 9
+  // Filter coefficients; each list is used both by the _filters[][] table below and by the compile-time kernels in Dither.cpp, so edit them here only.
+  #define FSf_coeffs			16, 7, -1, 3, 5, 1																//  Floyd-Steinberg filter
+  #define JJNf_coeffs			48, 7, 5, -2, 3, 5, 7, 5, 3, -2, 1, 3, 5, 3, 1		//  Jarvis, Judice and Ninke filter
+  #define STUf_coeffs			42, 8, 4, -2, 2, 4, 8, 4, 2, -2, 1, 2, 4, 2, 1		//  Stucki filter
+  #define BURf_coeffs			32, 8, 4, -2, 2, 4, 8, 4, 2												//  Burkes filter
+  #define SIE3f_coeffs		32, 5, 3, -2, 2, 4, 5, 4, 2, -1, 2, 3, 2					//  Sierra3 filter
+  #define SIE2f_coeffs		16, 4, 3, -2, 1, 2, 3, 2, 1												//  Sierra2 filter
+  #define SIE24f_coeffs		4, 2, -1, 1, 1																		//  Sierra-2-4A filter
+  #define ATKf_coeffs			8, 1, 1, -1, 1, 1, 1, -1, 0, 1										//  Atkinson filter
+  #define PERf_coeffs			8, 1, 1, -1, 0, 1, 1															//  Personal filter
   const int8_t _filters[filter_types][max_filter_entries] = {		// when -n, that's the number of columns we have to go back from the current pixel, on the next row.
-  	{16, 7, -1, 3, 5, 1, END},																	//  Floyd-Steinberg filter
-  	{48, 7, 5, -2, 3, 5, 7, 5, 3, -2, 1, 3, 5, 3, 1, END},			//  Jarvis, Judice and Ninke filter
-  	{42, 8, 4, -2, 2, 4, 8, 4, 2, -2, 1, 2, 4, 2, 1, END},			//  Stucki filter
-  	{32, 8, 4, -2, 2, 4, 8, 4, 2, END},										 	 		//  Burkes filter
-  	{32, 5, 3, -2, 2, 4, 5, 4, 2, -1, 2, 3, 2, END},		  			//  Sierra3 filter
-  	{16, 4, 3, -2, 1, 2, 3, 2, 1, END},													//  Sierra2 filter
-  	{4, 2, -1, 1, 1, END}, 																			//  Sierra-2-4A filter
-  	{8, 1, 1, -1, 1, 1, 1, -1, 0, 1, END},											//  Atkinson filter
-  	{8, 1, 1, -1, 0, 1, 1, END},																//  Personal filter
+  	{FSf_coeffs, END},
+  	{JJNf_coeffs, END},
+  	{STUf_coeffs, END},
+  	{BURf_coeffs, END},
+  	{SIE3f_coeffs, END},
+  	{SIE2f_coeffs, END},
+  	{SIE24f_coeffs, END},
+  	{ATKf_coeffs, END},
+  	{PERf_coeffs, END},
   };
   #define FSf			0
   #define JJNf		1
@@ -115,22 +427,113 @@ private:
   #define SIE24f	6
   #define ATKf		7
   #define PERf		8
+  #define CUSTf		9		// custom filter (see setCustomFilter); not part of _filters[][]
+  
+  int8_t _flattenFilter(uint8_t filter_index, _EDFilterTaps &taps);
+  
+  // For Custom filters
+  _EDFilterTaps *_custom = NULL;		// plan of the filter registered by setCustomFilter (NULL: none)
+  
+  // For Streaming error diffusion
+  int16_t *_stream_err = NULL;		// ring of (filter height + 1) error rows
+  uint32_t _stream_width = 0;
+  uint8_t _stream_rows, _stream_head, _stream_quant;
+  _EDFilterTaps _stream_taps;
+  
+  // For Color error diffusion
+  uint8_t *_palette = NULL;			// R, G, B triplets
+  uint16_t _palette_size = 0;
+  uint8_t *_color_lut = NULL;		// nearest palette entry of each (R, G, B) cell, DITHER_COLOR_LUT_BITS per channel
+  uint8_t *_color_mixed = NULL;		// 1 bit per cell: another entry is nearer to some of its pixels, which are searched one by one (NULL: none marked)
+  void _freePalette();
   
   
   
   // For Halftoning algorithms
-  #define _size 2														// Halftoning pattern size (square convolutional matrix); minimum is 1. The number of output gray shades obtainable is [1 + (_size)^2]. Values of _size powers of 2 are recommended on non-math enhanced or slow processors.
-  uint8_t _pattern[_size][_size] = {{0}};		// Halftoning pattern array
+  _DitherMatrix *_matrix = NULL;		// threshold matrix in use, from the shared cache (see DitherMatrix.h)
+  int8_t _useMatrix(uint8_t kind, uint8_t size);
+  
+  // For the Frame mode
+  uint8_t *_frame_state = NULL;		// per pixel: value it was quantized from (error diffusion) or output (point operations), in the last frame; plus one spare row
+  uint16_t _frame_width, _frame_height;
+  uint8_t _frame_algorithm, _frame_quant;
+  bool _frame_primed;							// false until a whole frame has been dithered, and after any change of the settings
+  int16_t _ditherFrame(uint8_t *frame, const uint8_t *prev_frame, const DitherRect *dirty, uint8_t dirty_count, DitherRect *changed, uint8_t max_changed, uint8_t *diff);
+  
+  // For the Latency budget (auto) mode
+  _DitherAuto *_auto = NULL;			// see setBudget; NULL: disabled
+  bool _autoCalibrated();					// the calibration matches the image size and settings
+  
+  // Point operations on the rows [call.first_row, call.end_row)
+  void _thresholdRows(const _DitherCall &call, uint8_t thresh);
+  int8_t _patternRows(const _DitherCall &call, int8_t thresh);
+  int8_t _patternLevelRows(const _DitherCall &call, int8_t thresh);		// quantization_bits > 1
+  int8_t _randomRows(const _DitherCall &call, int8_t thresh);
   
   // For Thresholding and Random dithering
-  #define _rnd_frame_width  1024	// use ONLY powers of 2 ; recommended a value twice as big as the image width (see documentation)
-  uint8_t _rnd_frame[_rnd_frame_width];
+  uint32_t _noise_seed = 0;
+  uint32_t _noise_frame = 0;		// advanced by each randomDither call without time consistency
   #define _use_low_amplitude_noise  true		// Usually, low amplitude noise is best (resembles more Gaussian distribution). Only sometimes high amplitude noise will result in a more pleasing image.
   
   // Helping functions (private)
-	uint8_t _Rnd(uint8_t seed = 150);
   inline uint8_t _twos_power(uint16_t number);
   inline uint8_t _clamp(int16_t v, uint8_t min, uint8_t max);
+  
+  Dither(const Dither &);						// not copyable: the buffers, the filter plan and the matrix reference are owned by the object
+  Dither &operator=(const Dither &);
+
+};
+
+// Dithers many independent images, each one with a Dither object of its own, on a pool of "threads" workers (0: one per core) that steal
+// jobs from each other when they run out of them. Returns the number of jobs that failed (see DitherJob::status), or -1.
+// Without DITHER_THREADS, the jobs run one after the other.
+int32_t ditherBatch(DitherJob *jobs, uint32_t count, uint8_t threads = 0);
+
+
+// Frame pipeline (see DitherPipeline): receives each dithered frame, in order, from the sink stage. data: the packed output, or the dithered
+// frame itself (DITHER_OUT_BYTES); it stays valid until the callback returns. frame: number of the frame, counted from 0.
+typedef void (*DitherSinkCallback)(const uint8_t *data, uint32_t bytes, uint32_t frame, void *user);
 
+// Counters of a pipeline, in microseconds (see DitherPipeline::getStats)
+struct DitherPipelineStats{
+	uint32_t frames;									// frames delivered to the sink
+	uint32_t dropped;									// acquireFrame(false) calls that found no free slot
+	uint32_t errors;									// frames the algorithm failed on (not delivered)
+	uint64_t wait_us;									// time acquireFrame() spent blocked on a full ring (backpressure)
+	uint32_t dither_us, dither_max_us;		// dither stage: last and peak time per frame ...
+	uint64_t dither_total_us;							// ... and total, for the average
+	uint32_t sink_us, sink_max_us;				// sink callback: the same
+	uint64_t sink_total_us;
+	uint32_t latency_us, latency_max_us;	// from submitFrame() to the end of the sink callback: last and peak
+};
+
+struct _PipelineState;
+
+/*
+	Frame pipeline: a ring of frame slots, a dither stage and a sink stage, each stage on a thread of its own, so that frame N + 1 is drawn
+	by the caller and dithered while frame N is still being sent to the display. The ring gives backpressure: acquireFrame() waits (or
+	fails, if asked not to wait) while every slot is in use. Frames always reach the sink in order.
+	The Dither object (with its settings: transfer, matrix, threads, ...) is used by the dither stage only: do not use it until end(). Its
+	output (setOutput) is taken over by the pipeline, and left disabled by end().
+	Without DITHER_THREADS, submitFrame() dithers the frame and calls the sink before returning, with a single slot.
+*/
+class DitherPipeline{
+ public:
+	DitherPipeline(){}
+	~DitherPipeline();
+	
+	// slots: 2 (double buffering) to 8; 3 lets drawing, dithering and sending all overlap. Each slot holds width * height bytes, plus the
+	// packed output of out_format (see setOutput) if any.
+	int8_t begin(Dither &dither, DitherSinkCallback sink, void *user = NULL, uint8_t algorithm = DITHER_FS, uint8_t quantization_bits = 1,
+							 uint8_t slots = 3, uint8_t out_format = DITHER_OUT_BYTES, uint32_t out_stride = 0);
+	uint8_t *acquireFrame(bool wait = true);		// slot to draw the next frame into (width * height gray bytes); NULL: none free (wait = false), or not started
+	int8_t submitFrame();												// queues the frame acquired last, and returns (see above for no DITHER_THREADS)
+	void end();																	// waits for the queued frames to reach the sink, stops the stages and frees the slots
+	void getStats(DitherPipelineStats &stats);
+	
+ private:
+	_PipelineState *_state = NULL;
+	DitherPipeline(const DitherPipeline &);						// not copyable
+	DitherPipeline &operator=(const DitherPipeline &);
 };
 
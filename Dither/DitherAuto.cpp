@@ -0,0 +1,258 @@
+/********************************************************************************
+Latency budget (auto) mode for the Dither library: the best algorithm that
+fits a time budget per frame, chosen from costs measured on the target and
+kept up to date by the time each frame actually takes.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "Dither.h"
+
+#if !defined(ARDUINO)
+	#include <chrono>
+
+	static uint32_t _autoMicros(){
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+#else
+	#define _autoMicros()  micros()
+#endif
+
+#define _auto_band_share  8		// the calibration times 1 / _auto_band_share of the rows ...
+#define _auto_band_min    8		// ... but at least this many
+#define _auto_overruns    2		// consecutive frames over the budget that make it step down
+#define _auto_review      32	// frames between two reviews of the choice (stepping back up, or down to the target) ...
+#define _auto_review_max  1024	// ... doubled, up to this, every time stepping up is undone by an overrun
+
+// Candidates, from the best quality to the cheapest. Error diffusion filters are ranked by how far (and how evenly) they spread the error;
+// ordered dithering comes before fastEDDither, since it has no artifacts and does not flicker between frames.
+static const uint8_t _auto_candidates[DITHER_AUTO_CANDIDATES] = {
+	DITHER_STUCKI, DITHER_JJN, DITHER_SIERRA3, DITHER_BURKES, DITHER_SIERRA2, DITHER_FS, DITHER_SIERRA24A, DITHER_ATKINSON,
+	DITHER_PATTERN, DITHER_FAST_ED, DITHER_RANDOM, DITHER_THRESHOLD,
+};
+
+struct _DitherAuto{
+	DitherCalibration calibration;
+	bool calibrated;
+	uint32_t budget_us, target_us;	// target: the share of the budget given by the preference
+	uint8_t max_bits;
+	uint8_t current;								// candidate in use
+	uint32_t time_us;								// time of the candidate in use, smoothed over the last frames
+	uint32_t scale;									// measured / calibrated time of the candidate in use, x256: applied to every candidate (not below 1)
+	uint8_t overruns;								// consecutive frames over the budget
+	uint16_t frames, review;				// frames since the last review, and between two reviews
+	bool climbed;										// the last review stepped up
+	uint8_t failed;									// candidate a step up to was undone by an overrun: skipped until a step up holds
+
+	static uint8_t bits(uint8_t algorithm, uint8_t max_bits){
+		return (algorithm <= DITHER_PERSONAL  ||  algorithm == DITHER_PATTERN)?  max_bits : 1;
+	}
+
+	// Calibrated cost, corrected by what the last frames took; never below the calibrated one, since the smallest costs are the least accurate
+	uint32_t predicted(uint8_t c){
+		uint64_t t = ((uint64_t)calibration.cost_us[c] * ((scale > 256)?  scale : 256)) >> 8;
+		return (t > 0xFFFFFFFF)?  0xFFFFFFFF : t;
+	}
+
+	// Best candidate that fits the target
+	uint8_t pick(){
+		for(uint8_t c = 0; c < DITHER_AUTO_CANDIDATES; c++){
+			if(predicted(c) <= target_us)  return c;
+		}
+		return DITHER_AUTO_CANDIDATES - 1;		// none does: the cheapest
+	}
+
+	// Nearest better candidate that fits the target with a 1/8 margin (so that the choice does not swing back and forth), or the current one.
+	// Up one candidate at a time: the measured time of the current one is a better guide for its neighbours than for the far ones.
+	uint8_t up(){
+		for(uint8_t c = current; c > 0; c--){
+			uint64_t t = predicted(c - 1);
+			if(c - 1 != failed  &&  t + t / 8 <= target_us)  return c - 1;
+		}
+		return current;
+	}
+
+	void use(uint8_t c){
+		current = c;
+		time_us = predicted(c);
+		overruns = 0;
+		frames = 0;
+	}
+
+	// New costs: first choice from them alone
+	void restart(){
+		scale = 256;
+		review = _auto_review;
+		climbed = false;
+		failed = DITHER_AUTO_CANDIDATES;
+		current = 0;
+		use(pick());
+	}
+
+	void update(uint32_t t){
+		time_us = time_us - time_us / 4 + t / 4;
+		uint32_t cost = calibration.cost_us[current];
+		uint64_t s = ((uint64_t)time_us << 8) / ((cost > 0)?  cost : 1);
+		scale = (s < 1)?  1 : (s > 0xFFFFFF)?  0xFFFFFF : s;
+		overruns = (t > budget_us)?  overruns + 1 : 0;
+
+		if(overruns >= _auto_overruns  ||  time_us > budget_us){
+			uint8_t c = pick();
+			if(c <= current){		// the costs are not that far off yet: at least the next candidate that is actually cheaper
+				c = current;
+				for(uint8_t n = current + 1; n < DITHER_AUTO_CANDIDATES  &&  c == current; n++){
+					if(calibration.cost_us[n] < calibration.cost_us[current])  c = n;
+				}
+			}
+			if(climbed){
+				if(review < _auto_review_max)  review *= 2;
+				failed = current;
+			}
+			climbed = false;
+			use(c);
+		}
+		else if(++frames >= review){
+			if(climbed){		// the step up has held
+				review = _auto_review;
+				failed = DITHER_AUTO_CANDIDATES;
+			}
+			climbed = false;
+			uint8_t c = pick();		// a cheaper one, if the frames have grown slower than the target
+			if(c < current){
+				c = up();
+				climbed = (c != current);
+			}
+			if(c != current)  use(c);
+			else  frames = 0;
+		}
+	}
+};
+
+
+int8_t Dither::setBudget(uint32_t budget_us, uint8_t preference, uint8_t max_bits){
+	if(budget_us == 0){
+		free(_auto);
+		_auto = NULL;
+		return 0;
+	}
+	if(preference > DITHER_PREFER_SPEED  ||  max_bits < 1  ||  max_bits > 7)  return -1;
+
+	if(_auto == NULL){
+		_auto = (_DitherAuto *)malloc(sizeof(_DitherAuto));
+		if(_auto == NULL)  return -1;		// not enough RAM
+		_auto->calibrated = false;
+	}
+	_auto->budget_us = budget_us;
+	_auto->target_us = budget_us - (budget_us / 4) * preference;
+	_auto->max_bits = max_bits;
+	if(_autoCalibrated())  _auto->restart();
+	return 0;
+}
+
+bool Dither::_autoCalibrated(){
+	const DitherCalibration &c = _auto->calibration;
+	return _auto->calibrated  &&  c.width == _img_width  &&  c.height == _img_height  &&  c.threads == _threads  &&  c.tile_size == _tile_size  &&
+				 c.quantization_bits == _auto->max_bits;
+}
+
+// Each candidate dithers a band of rows out of place (from the middle of the sample, or from a ramp), twice: the faster run counts, so that
+// building a matrix or warming up the caches is left out. The packed output and the statistics are left out too.
+int8_t Dither::calibrate(const uint8_t *sample){
+	if(_auto == NULL  ||  _img_width == 0  ||  _img_height == 0)  return -1;
+
+	uint16_t rows = _img_height / _auto_band_share;
+	if(rows < _auto_band_min)  rows = (_img_height < _auto_band_min)?  _img_height : _auto_band_min;
+	const uint32_t pixels = (uint32_t)_img_width * rows;
+	uint8_t *work = (uint8_t *)malloc((sample == NULL)?  2 * (size_t)pixels : pixels);
+	if(work == NULL)  return -1;
+
+	DitherRect band = {0, (uint16_t)((_img_height - rows) / 2), _img_width, rows};
+	if(sample == NULL){
+		uint8_t *ramp = work + pixels;
+		for(uint32_t x = 0; x < _img_width; x++)  ramp[x] = (_img_width > 1)?  x * 255 / (_img_width - 1) : 128;
+		for(uint16_t y = 1; y < rows; y++)  memcpy(ramp + (uint32_t)y * _img_width, ramp, _img_width);
+		sample = ramp;
+		band.y = 0;
+	}
+
+	uint8_t *out_buffer = _out_buffer;
+	DitherStats *stats = _stats;
+	DitherStatsCallback stats_callback = _stats_callback;
+	_out_buffer = NULL;
+	_stats = NULL;
+	_stats_callback = NULL;
+
+	DitherCalibration &cal = _auto->calibration;
+	int8_t res = 0;
+	for(uint8_t c = 0; res == 0  &&  c < DITHER_AUTO_CANDIDATES; c++){
+		uint8_t algorithm = _auto_candidates[c];
+		uint32_t best = 0xFFFFFFFF;
+		for(uint8_t run = 0; res == 0  &&  run < 2; run++){
+			uint32_t start = _autoMicros();
+			res = dither(sample, 0, work, 0, &band, algorithm, _DitherAuto::bits(algorithm, _auto->max_bits));
+			uint32_t t = _autoMicros() - start;
+			if(t < best)  best = t;
+		}
+		uint64_t cost = (uint64_t)best * _img_height / rows;
+		cal.cost_us[c] = (cost > 0xFFFFFFFF)?  0xFFFFFFFF : cost;
+	}
+
+	_out_buffer = out_buffer;
+	_stats = stats;
+	_stats_callback = stats_callback;
+	free(work);
+
+	_auto->calibrated = (res == 0);
+	if(res < 0)  return -1;
+	cal.width = _img_width;
+	cal.height = _img_height;
+	cal.threads = _threads;
+	cal.tile_size = _tile_size;
+	cal.quantization_bits = _auto->max_bits;
+	_auto->restart();
+	return 0;
+}
+
+int8_t Dither::ditherAuto(uint8_t *IMG_pixel){
+	if(_auto == NULL  ||  IMG_pixel == NULL)  return -1;
+	if(!_autoCalibrated()  &&  calibrate(IMG_pixel) < 0)  return -1;		// first frame, or the size or settings have changed
+
+	uint8_t algorithm = _auto_candidates[_auto->current];
+	uint32_t start = _autoMicros();
+	if(dither(IMG_pixel, algorithm, _DitherAuto::bits(algorithm, _auto->max_bits)) < 0)  return -1;
+	_auto->update(_autoMicros() - start);
+	return algorithm;
+}
+
+int8_t Dither::getAutoChoice(uint8_t &algorithm, uint8_t &quantization_bits){
+	if(_auto == NULL  ||  !_autoCalibrated())  return -1;
+	algorithm = _auto_candidates[_auto->current];
+	quantization_bits = _DitherAuto::bits(algorithm, _auto->max_bits);
+	return 0;
+}
+
+int8_t Dither::getCalibration(DitherCalibration &calibration){
+	if(_auto == NULL  ||  !_auto->calibrated)  return -1;
+	calibration = _auto->calibration;
+	return 0;
+}
+
+int8_t Dither::setCalibration(const DitherCalibration &calibration){
+	if(_auto == NULL)  return -1;
+	bool calibrated = _auto->calibrated;
+	DitherCalibration previous = _auto->calibration;
+	_auto->calibration = calibration;
+	_auto->calibrated = true;
+	if(!_autoCalibrated()){		// measured for another size or other settings
+		_auto->calibration = previous;
+		_auto->calibrated = calibrated;
+		return -1;
+	}
+	_auto->restart();
+	return 0;
+}
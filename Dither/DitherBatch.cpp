@@ -0,0 +1,150 @@
+/********************************************************************************
+Batch dithering for the Dither library: many independent images, each one
+with its own Dither object, spread over a pool of worker threads.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "Dither.h"
+
+#if DITHER_THREADS
+	#include <thread>
+	#include <mutex>
+	#include <new>
+#endif
+
+#if DITHER_THREADS  ||  !defined(ARDUINO)
+	#include <chrono>
+
+	static uint32_t _batchMicros(){
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+#else
+	#define _batchMicros()  micros()
+#endif
+
+
+// Every job gets a fresh object: settings, tables and noise state of a job can never leak into another one.
+// The object lives on the heap, since worker threads may have small stacks (e.g. 3kB on ESP32).
+static void _runJob(DitherJob &job){
+
+	uint32_t start = _batchMicros();
+	job.status = -1;
+
+	if(job.buffer  &&  job.width  &&  job.height){
+		#if DITHER_THREADS
+		Dither *d = new (std::nothrow) Dither(job.width, job.height, job.invert_output);
+		#else
+		Dither *d = new Dither(job.width, job.height, job.invert_output);
+		#endif
+		if(d){
+			if(d->setTransfer(job.gamma, job.contrast, job.brightness) == 0){
+				d->setOutput(job.output, job.output_format, job.output_stride);
+				job.status = d->dither(job.buffer, job.algorithm, job.quantization_bits);
+			}
+			delete d;
+		}
+	}
+
+	job.time_us = _batchMicros() - start;
+}
+
+
+#if DITHER_THREADS
+
+/*
+	Work stealing: each worker starts with a contiguous share of the jobs, and takes them one at a time from the front of its queue.
+	When its queue is empty, it steals the back half of another worker's queue, so that a few big images (or a slow core) do not
+	leave the other workers idle. Queues only hold a range of job indices, so a steal moves no data.
+	No job is ever added, so a worker can stop as soon as it finds every queue empty.
+*/
+struct _BatchQueue{
+	std::mutex lock;
+	uint32_t head, tail;			// jobs [head, tail) are still to be run
+};
+
+static bool _batchTake(_BatchQueue &q, uint32_t &job){
+	std::lock_guard<std::mutex> guard(q.lock);
+	if(q.head >= q.tail)  return false;
+	job = q.head++;
+	return true;
+}
+
+static bool _batchSteal(_BatchQueue &victim, _BatchQueue &own){
+	uint32_t first, last;
+	{
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if(victim.head >= victim.tail)  return false;
+		last = victim.tail;
+		first = last - (last - victim.head + 1) / 2;
+		victim.tail = first;
+	}
+	std::lock_guard<std::mutex> guard(own.lock);
+	own.head = first;
+	own.tail = last;
+	return true;
+}
+
+#endif
+
+
+int32_t ditherBatch(DitherJob *jobs, uint32_t count, uint8_t threads){
+
+	if(jobs == NULL  &&  count > 0)  return -1;
+	bool done = false;
+
+	#if DITHER_THREADS
+	if(threads == 0){		// as many workers as cores
+		unsigned hw = std::thread::hardware_concurrency();
+		threads = (hw == 0)?  1 : (hw > 255)?  255 : hw;
+	}
+	if(threads > count)  threads = count;
+
+	if(threads > 1){
+		_BatchQueue *queues = new (std::nothrow) _BatchQueue[threads];
+		std::thread *pool = new (std::nothrow) std::thread[threads - 1];
+		if(queues  &&  pool){
+			for(uint8_t t = 0; t < threads; t++){
+				queues[t].head = (uint64_t)count * t / threads;
+				queues[t].tail = (uint64_t)count * (t + 1) / threads;
+			}
+
+			auto worker = [&](uint8_t id){
+				uint32_t job;
+				while(true){
+					if(_batchTake(queues[id], job)){
+						_runJob(jobs[job]);
+						continue;
+					}
+					uint8_t v = 1;
+					while(v < threads  &&  !_batchSteal(queues[(id + v) % threads], queues[id]))  v++;
+					if(v == threads)  return;		// nothing left anywhere
+				}
+			};
+
+			for(uint8_t t = 1; t < threads; t++)  pool[t - 1] = std::thread(worker, t);
+			worker(0);
+			for(uint8_t t = 1; t < threads; t++)  pool[t - 1].join();
+
+			done = true;
+		}
+		delete[] pool;		// without enough RAM for the pool, the jobs run here
+		delete[] queues;
+	}
+	#else
+	(void)threads;		// no pool without DITHER_THREADS
+	#endif
+
+	if(!done){
+		for(uint32_t j = 0; j < count; j++)  _runJob(jobs[j]);
+	}
+
+	int32_t failed = 0;
+	for(uint32_t j = 0; j < count; j++)  failed += (jobs[j].status < 0);
+	return failed;
+}
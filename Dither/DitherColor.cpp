@@ -0,0 +1,219 @@
+/********************************************************************************
+Color error diffusion for the Dither library: RGB888 and RGB565 images are
+dithered in a single pass to an arbitrary palette (up to 256 colors).
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "Dither.h"
+
+#define _lut_side  (1 << DITHER_COLOR_LUT_BITS)
+
+static const uint8_t _pal_eink6[6 * 3] = {
+	0x00, 0x00, 0x00,		0xFF, 0xFF, 0xFF,		0xFF, 0x00, 0x00,
+	0x00, 0xFF, 0x00,		0x00, 0x00, 0xFF,		0xFF, 0xFF, 0x00,
+};
+
+static const uint8_t _pal_ega16[16 * 3] = {
+	0x00, 0x00, 0x00,		0x00, 0x00, 0xAA,		0x00, 0xAA, 0x00,		0x00, 0xAA, 0xAA,
+	0xAA, 0x00, 0x00,		0xAA, 0x00, 0xAA,		0xAA, 0x55, 0x00,		0xAA, 0xAA, 0xAA,
+	0x55, 0x55, 0x55,		0x55, 0x55, 0xFF,		0x55, 0xFF, 0x55,		0x55, 0xFF, 0xFF,
+	0xFF, 0x55, 0x55,		0xFF, 0x55, 0xFF,		0xFF, 0xFF, 0x55,		0xFF, 0xFF, 0xFF,
+};
+
+
+int8_t Dither::setPalette(uint8_t builtin_palette){
+	switch(builtin_palette){
+		case DITHER_PAL_EINK6:  return setPalette(_pal_eink6, 6);
+		case DITHER_PAL_EGA16:  return setPalette(_pal_ega16, 16);
+		case DITHER_PAL_RGB332:{
+			uint8_t *rgb = (uint8_t *)malloc(256 * 3);
+			if(rgb == NULL)  return -1;
+			for(uint16_t c = 0; c < 256; c++)  color332To888(c, rgb[3 * c], rgb[3 * c + 1], rgb[3 * c + 2]);
+			int8_t res = setPalette(rgb, 256);
+			free(rgb);
+			return res;
+		}
+	}
+	return -1;		// unknown palette
+}
+
+// Palette entry nearest to (r, g, b); the first one, on a tie
+static uint8_t _nearestEntry(const uint8_t *palette, uint16_t count, int16_t r, int16_t g, int16_t b){
+	uint32_t best_dist = 0xFFFFFFFF;
+	uint8_t best = 0;
+	for(uint16_t p = 0; p < count; p++, palette += 3){
+		int16_t dr = r - palette[0], dg = g - palette[1], db = b - palette[2];
+		uint32_t dist = (int32_t)dr * dr + (int32_t)dg * dg + (int32_t)db * db;
+		if(dist < best_dist){
+			best_dist = dist;
+			best = p;
+		}
+	}
+	return best;
+}
+
+// Whether entry p is what _nearestEntry gives for every pixel of the cell [lo, lo + side)^3. The pixels nearer to q than to p are on one side
+// of a plane, |x - p|^2 - |x - q|^2 = 2 x.(q - p) + |p|^2 - |q|^2 > 0 (or = 0, when q comes first on a tie): its largest value over the cell
+// is at the corner that is farthest along q - p.
+static bool _cellIsPure(const uint8_t *palette, uint16_t count, uint8_t p, const int16_t lo[3], int16_t side){
+	const uint8_t *pp = palette + 3 * p;
+	const int32_t pn = (int32_t)pp[0] * pp[0] + (int32_t)pp[1] * pp[1] + (int32_t)pp[2] * pp[2];
+	for(uint16_t q = 0; q < count; q++){
+		const uint8_t *pq = palette + 3 * q;
+		int32_t f = pn - ((int32_t)pq[0] * pq[0] + (int32_t)pq[1] * pq[1] + (int32_t)pq[2] * pq[2]);
+		for(uint8_t k = 0; k < 3; k++){
+			int16_t d = (int16_t)pq[k] - pp[k];
+			f += 2 * (int32_t)d * ((d > 0)?  lo[k] + side - 1 : lo[k]);
+		}
+		if(q != p  &&  (f > 0  ||  (f == 0  &&  q < p)))  return false;
+	}
+	return true;
+}
+
+// Copies the palette, and fills the lookup table: each (R, G, B) cell holds the palette entry nearest to its center.
+// The table is built once per palette, so that dithering needs a single memory access per pixel instead of a search through the palette.
+// Small palettes also get the cells crossed by a boundary between two entries marked, so that only their pixels are searched.
+int8_t Dither::setPalette(const uint8_t *rgb888, uint16_t count){
+
+	_freePalette();
+	if(rgb888 == NULL  ||  count == 0  ||  count > 256)  return -1;
+
+	_palette = (uint8_t *)malloc(count * 3);
+	_color_lut = (uint8_t *)malloc((uint32_t)_lut_side * _lut_side * _lut_side);
+	if(count <= DITHER_COLOR_EXACT)  _color_mixed = (uint8_t *)calloc(((uint32_t)_lut_side * _lut_side * _lut_side + 7) / 8, 1);
+	if(_palette == NULL  ||  _color_lut == NULL  ||  (count <= DITHER_COLOR_EXACT  &&  _color_mixed == NULL)){
+		_freePalette();
+		return -1;		// not enough RAM
+	}
+	memcpy(_palette, rgb888, count * 3);
+	_palette_size = count;
+
+	const uint8_t shift = 8 - DITHER_COLOR_LUT_BITS, half = (1 << shift) >> 1;
+	uint32_t cell = 0;
+	for(uint16_t r = 0; r < _lut_side; r++){
+		for(uint16_t g = 0; g < _lut_side; g++){
+			for(uint16_t b = 0; b < _lut_side; b++, cell++){
+				const int16_t lo[3] = {(int16_t)(r << shift), (int16_t)(g << shift), (int16_t)(b << shift)};
+				uint8_t best = _nearestEntry(_palette, count, lo[0] + half, lo[1] + half, lo[2] + half);
+				_color_lut[cell] = best;
+				if(_color_mixed  &&  !_cellIsPure(_palette, count, best, lo, 1 << shift))  _color_mixed[cell >> 3] |= 1 << (cell & 7);
+			}
+		}
+	}
+	return 0;
+}
+
+void Dither::_freePalette(){
+	free(_palette);
+	free(_color_lut);
+	free(_color_mixed);
+	_palette = NULL;
+	_color_lut = NULL;
+	_color_mixed = NULL;
+	_palette_size = 0;
+}
+
+
+// Color error diffusion. As for the streaming functions, errors (one per channel) are carried in a ring of (filter height + 1)
+// signed rows rather than in the image itself, and taps falling outside the image are dropped. Output inversion does not apply to colors.
+int8_t Dither::colorDither(uint8_t *IMG_pixel, uint8_t pixel_format, uint8_t filter_index, uint8_t *palette_indices){
+
+	if(_color_lut == NULL)  return -1;		// setPalette() has not been called
+	if(pixel_format != DITHER_RGB888  &&  pixel_format != DITHER_RGB565)  return -1;
+
+	_EDFilterTaps taps;
+	if(_flattenFilter(filter_index, taps) < 0)  return -1;
+
+	const uint16_t width = _img_width;
+	const uint32_t err_row = (uint32_t)width * 3;
+	const uint8_t rows = taps.height + 1;
+	int16_t *errors = (int16_t *)calloc(rows * err_row, sizeof(int16_t));
+	if(errors == NULL)  return -1;		// not enough RAM
+
+	const uint8_t pix_len = (pixel_format == DITHER_RGB565)?  2 : 3;
+	const uint8_t lut_shift = 8 - DITHER_COLOR_LUT_BITS;
+
+	// Columns [first, last) have all of their taps inside the row
+	const uint16_t first = (taps.left < width)?  taps.left : width;
+	const uint16_t last = (width > taps.right + first)?  width - taps.right : first;
+
+	uint8_t head = 0;
+	uint8_t *pix = IMG_pixel;
+
+	for(uint16_t row = 0; row < _img_height; row++){
+		int16_t *curr = errors + head * err_row;
+		int16_t *dest[DITHER_MAX_FILTER_TAPS];		// error row reached by each tap, already shifted by the tap column
+		for(uint8_t t = 0; t < taps.count; t++){
+			dest[t] = errors + ((head + taps.dy[t]) % rows) * err_row + taps.dx[t] * 3;
+		}
+
+		for(uint16_t col = 0; col < width; col++, pix += pix_len){
+			uint8_t c[3];
+			uint16_t c565;
+			if(pixel_format == DITHER_RGB565){
+				memcpy(&c565, pix, 2);
+				color565To888(c565, c[0], c[1], c[2]);
+			}
+			else{
+				c[0] = pix[0];
+				c[1] = pix[1];
+				c[2] = pix[2];
+			}
+
+			// Add the diffused error (after the input transfer, if any), and look up the nearest palette color
+			int16_t v[3], s[3];
+			for(uint8_t k = 0; k < 3; k++){
+				v[k] = (_transfer?  _transfer[c[k]] : c[k]) + curr[3 * col + k];
+				s[k] = (v[k] < 0)? 0 : (v[k] > 255)? 255 : v[k];
+			}
+			uint32_t cell = ((uint32_t)(s[0] >> lut_shift) << (2 * DITHER_COLOR_LUT_BITS)) | ((s[1] >> lut_shift) << DITHER_COLOR_LUT_BITS) | (s[2] >> lut_shift);
+			uint8_t idx = _color_lut[cell];
+			if(_color_mixed  &&  (_color_mixed[cell >> 3] >> (cell & 7)) & 1)  idx = _nearestEntry(_palette, _palette_size, s[0], s[1], s[2]);
+			const uint8_t *pal = _palette + 3 * idx;
+
+			if(pixel_format == DITHER_RGB565){
+				c565 = color888To565(pal[0], pal[1], pal[2]);
+				memcpy(pix, &c565, 2);
+			}
+			else{
+				pix[0] = pal[0];
+				pix[1] = pal[1];
+				pix[2] = pal[2];
+			}
+			if(palette_indices)  *palette_indices++ = idx;
+
+			// Distribute the error of each channel
+			int16_t err[3];
+			for(uint8_t k = 0; k < 3; k++){
+				err[k] = v[k] - pal[k];
+				if(err[k] > 255)  err[k] = 255;		// keeps |err * weight| in the exact range of the normalization
+				else if(err[k] < -255)  err[k] = -255;
+			}
+
+			bool inside = (col >= first  &&  col < last);
+			for(uint8_t t = 0; t < taps.count; t++){
+				if(!inside){
+					int32_t x = (int32_t)col + taps.dx[t];
+					if(x < 0  ||  x >= width)  continue;
+				}
+				int16_t *e = dest[t] + 3 * col;
+				e[0] += _normalizeError(err[0] * taps.weight[t], taps);
+				e[1] += _normalizeError(err[1] * taps.weight[t], taps);
+				e[2] += _normalizeError(err[2] * taps.weight[t], taps);
+			}
+		}
+
+		// The current row becomes the farthest one of the ring
+		memset(curr, 0, err_row * sizeof(int16_t));
+		head = (head + 1) % rows;
+	}
+
+	free(errors);
+	return 0;
+}
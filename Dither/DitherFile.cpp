@@ -0,0 +1,193 @@
+/********************************************************************************
+File pipeline for the Dither library: binary PGM images of any size (up to
+2^32 - 1 pixels per side) are dithered row by row into PBM, PGM or raw packed
+files, with bounded memory and sequential I/O.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "Dither.h"
+
+#if DITHER_FILE_IO
+
+#include <stdio.h>
+
+// On POSIX systems the input is memory-mapped: rows are read straight from the page cache, with no copy
+#if defined(__unix__)  ||  defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define _file_mmap  1
+#else
+	#define _file_mmap  0
+#endif
+
+#define _file_release_bytes  (8UL << 20)		// mapped input already dithered is given back every 8MB, so that it does not pile up in RAM
+
+
+// Reads the next number of a PGM header (as _pgmNumber in DitherMatrix.cpp, on 64 bits)
+static int64_t _fileNumber(FILE *f){
+	int c = fgetc(f);
+	while(c == '#'  ||  c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n'){
+		if(c == '#'){
+			while(c != '\n'  &&  c != EOF)  c = fgetc(f);
+		}
+		c = fgetc(f);
+	}
+	int64_t v = -1;
+	for(; c >= '0'  &&  c <= '9'  &&  v < 0x100000000LL; c = fgetc(f))  v = ((v < 0)? 0 : v * 10) + (c - '0');
+	return v;		// the single white space after the number has been consumed, as PGM requires before the pixel data
+}
+
+// Input rows, from the mapped file or read into a buffer; samples are converted to 8 bit when maxval is not 255
+struct _FileReader{
+	FILE *f;
+	uint32_t width;
+	uint16_t maxval;
+	uint64_t data_offset, row_bytes;
+	uint8_t *raw;						// one row as stored in the file (read mode, or conversion)
+	uint8_t *row;						// one row of 8 bit samples (conversion only)
+	#if _file_mmap
+	uint8_t *map;
+	uint64_t map_size, released;
+	#endif
+
+	bool open(uint64_t height){
+		raw = row = NULL;
+		#if _file_mmap
+		map = NULL;
+		#endif
+		const bool convert = (maxval != 255);
+		if(convert  &&  (row = (uint8_t *)malloc(width)) == NULL)  return false;
+
+		#if _file_mmap
+		struct stat st;
+		map_size = data_offset + row_bytes * height;
+		released = 0;
+		if(fstat(fileno(f), &st) == 0  &&  (uint64_t)st.st_size >= map_size  &&  map_size == (size_t)map_size){
+			void *m = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+			if(m != MAP_FAILED){
+				map = (uint8_t *)m;
+				madvise(map, map_size, MADV_SEQUENTIAL);
+				return true;
+			}
+		}
+		#else
+		(void)height;
+		#endif
+
+		// Buffered reads (no mmap, or a file that could not be mapped)
+		if(row_bytes != (size_t)row_bytes  ||  (raw = (uint8_t *)malloc(row_bytes)) == NULL)  return false;
+		return fseek(f, data_offset, SEEK_SET) == 0;
+	}
+
+	const uint8_t *next(uint64_t r){
+		const uint8_t *src;
+		#if _file_mmap
+		if(map){
+			src = map + data_offset + r * row_bytes;
+			uint64_t done = data_offset + r * row_bytes;
+			if(done - released >= _file_release_bytes){		// whole pages behind the current row are not needed anymore
+				const uint64_t page = sysconf(_SC_PAGESIZE);
+				uint64_t end = done / page * page;
+				if(end > released)  madvise(map + released, end - released, MADV_DONTNEED);
+				released = end;
+			}
+		}
+		else
+		#else
+		(void)r;
+		#endif
+		{
+			if(fread(raw, 1, row_bytes, f) != row_bytes)  return NULL;		// truncated file
+			src = raw;
+		}
+		if(maxval == 255)  return src;
+
+		// 16 bit samples are big endian; both kinds are scaled to [0 : 255], rounding to nearest
+		if(maxval > 255){
+			for(uint32_t x = 0; x < width; x++)  row[x] = (((uint32_t)src[2 * x] << 8 | src[2 * x + 1]) * 255 + maxval / 2) / maxval;
+		}
+		else{
+			for(uint32_t x = 0; x < width; x++)  row[x] = ((uint32_t)src[x] * 255 + maxval / 2) / maxval;
+		}
+		return row;
+	}
+
+	void close(){
+		#if _file_mmap
+		if(map)  munmap(map, map_size);
+		#endif
+		free(raw);
+		free(row);
+	}
+};
+
+
+int8_t Dither::ditherFile(const char *pgm_path, const char *out_path, uint8_t filter_index, uint8_t out_format, uint8_t quantization_bits){
+
+	if(out_format == DITHER_OUT_PBM  ||  out_format == DITHER_OUT_1BPP)  quantization_bits = 1;
+	else if((out_format == DITHER_OUT_2BPP  &&  quantization_bits > 2)  ||  (out_format == DITHER_OUT_4BPP  &&  quantization_bits > 4))  return -1;		// more levels than the format can hold
+	else if(out_format != DITHER_OUT_BYTES  &&  out_format != DITHER_OUT_2BPP  &&  out_format != DITHER_OUT_4BPP)  return -1;
+
+	FILE *in = fopen(pgm_path, "rb");
+	if(in == NULL)  return -1;
+
+	int64_t w = -1, h = -1, maxval = -1;
+	if(fgetc(in) == 'P'  &&  fgetc(in) == '5'){
+		w = _fileNumber(in);
+		h = _fileNumber(in);
+		maxval = _fileNumber(in);
+	}
+	if(w < 1  ||  w > 0xFFFFFFFFLL  ||  h < 1  ||  h > 0xFFFFFFFFLL  ||  maxval < 1  ||  maxval > 65535){
+		fclose(in);
+		return -1;		// not a binary PGM
+	}
+
+	_FileReader reader;
+	reader.f = in;
+	reader.width = w;
+	reader.maxval = maxval;
+	reader.data_offset = ftell(in);
+	reader.row_bytes = (uint64_t)w * ((maxval > 255)?  2 : 1);
+
+	FILE *out = NULL;
+	uint8_t *out_row = NULL, *packed = NULL;
+	size_t packed_bytes = (out_format == DITHER_OUT_2BPP)?  ((size_t)w + 3) / 4 : (out_format == DITHER_OUT_4BPP)?  ((size_t)w + 1) / 2 : ((size_t)w + 7) / 8;
+
+	bool ok = reader.open(h)  &&  beginStream(w, filter_index, quantization_bits) == 0;
+	ok = ok  &&  (out_row = (uint8_t *)malloc(w)) != NULL;
+	ok = ok  &&  (out_format == DITHER_OUT_BYTES  ||  (packed = (uint8_t *)malloc(packed_bytes)) != NULL);
+	ok = ok  &&  (out = fopen(out_path, "wb")) != NULL;
+
+	if(ok  &&  out_format == DITHER_OUT_PBM)  ok = fprintf(out, "P4\n%llu %llu\n", (unsigned long long)w, (unsigned long long)h) > 0;
+	if(ok  &&  out_format == DITHER_OUT_BYTES)  ok = fprintf(out, "P5\n%llu %llu\n255\n", (unsigned long long)w, (unsigned long long)h) > 0;
+
+	for(uint64_t r = 0; ok  &&  r < (uint64_t)h; r++){
+		const uint8_t *in_row = reader.next(r);
+		ok = (in_row != NULL)  &&  ditherRow(in_row, out_row) == 0;
+		if(!ok)  break;
+		if(out_format == DITHER_OUT_BYTES){
+			ok = fwrite(out_row, 1, w, out) == (size_t)w;
+		}
+		else{
+			_packRow(out_row, packed, w, out_format);
+			ok = fwrite(packed, 1, packed_bytes, out) == packed_bytes;
+		}
+	}
+
+	endStream();
+	reader.close();
+	fclose(in);
+	free(out_row);
+	free(packed);
+	if(out  &&  fclose(out) != 0)  ok = false;
+	return ok?  0 : -1;
+}
+
+#endif
@@ -0,0 +1,392 @@
+/********************************************************************************
+Threshold matrices for ordered dithering (see DitherMatrix.h): recursive
+Bayer and clustered (spiral) matrices of any size up to 64x64, and blue
+noise textures (void-and-cluster) up to 128x128.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "Dither.h"
+#include "DitherSIMD.h"
+#include "DitherMatrix.h"
+
+#if DITHER_THREADS
+	#include <mutex>
+	static std::mutex _matrix_lock;
+	#define _matrixLock()    _matrix_lock.lock()
+	#define _matrixUnlock()  _matrix_lock.unlock()
+#else
+	#define _matrixLock()
+	#define _matrixUnlock()
+#endif
+
+static_assert(DITHER_MAX_PATTERN_SIZE <= 128  &&  DITHER_MAX_NOISE_SIZE <= 128  &&  _point_chunk <= 64, "tiled rows would not fit in _max_matrix_tile");
+
+static _DitherMatrix _matrix_cache[_matrix_cache_slots];
+
+
+// Recursive Bayer matrix: M(2n) = [4 M(n), 4 M(n) + 2 ; 4 M(n) + 3, 4 M(n) + 1]. Unrolling the recursion, each bit of (x, y) picks 2 bits
+// of the rank: the least significant bits of the coordinates give the most significant ones.
+static void _bayerRanks(uint16_t *rank, uint8_t size){
+	static const uint8_t quadrant[2][2] = {{0, 2}, {3, 1}};
+	uint8_t bits = 0;
+	while((1 << bits) < size)  bits++;
+
+	for(uint8_t y = 0; y < size; y++){
+		for(uint8_t x = 0; x < size; x++){
+			uint16_t r = 0;
+			for(uint8_t k = 0; k < bits; k++)  r |= quadrant[(y >> k) & 1][(x >> k) & 1] << (2 * (bits - 1 - k));
+			rank[y * size + x] = r;
+		}
+	}
+}
+
+// Clustered matrix: ranks grow along a spiral, from the outer ring inwards (as in the original fixed-size pattern),
+// so that tiled matrices grow dots centered in each tile.
+static void _clusteredRanks(uint16_t *rank, uint8_t size){
+	int16_t m = size, n = size, k = 0, l = 0;
+	uint16_t val = 0;
+
+	while(k < m  &&  l < n){
+		for(int16_t i = l; i < n; ++i)  rank[k * size + i] = val++;
+		k++;
+
+		for(int16_t i = k; i < m; ++i)  rank[i * size + n - 1] = val++;
+		n--;
+
+		if(k < m){
+			for(int16_t i = n - 1; i >= l; --i)  rank[(m - 1) * size + i] = val++;
+			m--;
+		}
+
+		if(l < n){
+			for(int16_t i = m - 1; i >= k; --i)  rank[i * size + l] = val++;
+			l++;
+		}
+	}
+}
+
+/*
+	Blue noise texture, generated with the void-and-cluster method (R. Ulichney, 1993). The "energy" of a pixel is the sum of a gaussian
+	(sigma = 1.5) centered on each set pixel, wrapping around the edges so that the texture tiles seamlessly: the tightest cluster is the
+	set pixel with the highest energy, the largest void the empty pixel with the lowest one.
+	1) a few random pixels (1/10) are set, then the tightest cluster is moved into the largest void until it lands back where it was;
+	2) the pixels of this pattern are ranked by removing the tightest cluster, one at a time;
+	3) all of the other pixels are ranked by filling the largest void, one at a time (past half of the pixels this is the same as the
+	   "tightest cluster of empty pixels" of the original method, since the energy of empty pixels is the total minus the one of set pixels).
+	Energies are fixed point integers, and the initial pattern comes from a fixed seed: the texture is the same on every run and platform.
+*/
+#define _noise_radius  6		// the gaussian is cut beyond 4 sigma
+
+struct _VoidAndCluster{
+	uint8_t size, radius;
+	uint8_t *set;
+	uint32_t *energy;
+	uint32_t gauss[_noise_radius + 1][_noise_radius + 1];		// gauss[|dy|][|dx|], 1.0 = 65536
+	
+	void splat(uint16_t p, bool add){
+		const int16_t px = p % size, py = p / size;
+		for(int16_t dy = -radius; dy <= radius; dy++){
+			uint16_t row = ((py + dy + size) % size) * size;
+			for(int16_t dx = -radius; dx <= radius; dx++){
+				uint32_t g = gauss[(dy < 0)? -dy : dy][(dx < 0)? -dx : dx];
+				uint32_t &e = energy[row + (px + dx + size) % size];
+				e = add?  e + g : e - g;
+			}
+		}
+		set[p] = add;
+	}
+	
+	uint16_t tightestCluster(){
+		const uint16_t n = size * size;
+		uint16_t best = 0;
+		uint32_t best_e = 0;
+		for(uint16_t p = 0; p < n; p++){
+			if(set[p]  &&  energy[p] >= best_e){
+				best_e = energy[p];
+				best = p;
+			}
+		}
+		return best;
+	}
+	
+	uint16_t largestVoid(){
+		const uint16_t n = size * size;
+		uint16_t best = 0;
+		uint32_t best_e = 0xFFFFFFFF;
+		for(uint16_t p = 0; p < n; p++){
+			if(!set[p]  &&  energy[p] < best_e){
+				best_e = energy[p];
+				best = p;
+			}
+		}
+		return best;
+	}
+};
+
+static int8_t _blueNoiseRanks(uint16_t *rank, uint8_t size){
+	const uint16_t n = size * size;
+	_VoidAndCluster vc;
+	vc.size = size;
+	vc.radius = (size <= 2 * _noise_radius)?  (size - 1) / 2 : _noise_radius;		// on small textures, no pixel is reached twice
+	vc.set = (uint8_t *)calloc(n, 1);
+	vc.energy = (uint32_t *)calloc(n, sizeof(uint32_t));
+	uint8_t *initial = (uint8_t *)malloc(n);
+	if(vc.set == NULL  ||  vc.energy == NULL  ||  initial == NULL){
+		free(vc.set);
+		free(vc.energy);
+		free(initial);
+		return -1;		// not enough RAM
+	}
+	
+	for(uint8_t dy = 0; dy <= _noise_radius; dy++){
+		for(uint8_t dx = 0; dx <= _noise_radius; dx++)  vc.gauss[dy][dx] = 65536.0 * exp(-(dx * dx + dy * dy) / (2 * 1.5 * 1.5)) + 0.5;
+	}
+	
+	// 1) initial pattern: random pixels, then spread evenly
+	uint32_t seed = 0x9E3779B9;
+	uint16_t ones = (n >= 20)?  n / 10 : 2;
+	for(uint16_t placed = 0; placed < ones; ){
+		seed ^= seed << 13;		// xorshift32
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		uint16_t p = seed % n;
+		if(!vc.set[p]){
+			vc.splat(p, true);
+			placed++;
+		}
+	}
+	for(uint32_t iter = 0; iter < n; iter++){
+		uint16_t cluster = vc.tightestCluster();
+		vc.splat(cluster, false);
+		uint16_t hole = vc.largestVoid();
+		vc.splat(hole, true);
+		if(hole == cluster)  break;		// converged
+	}
+	memcpy(initial, vc.set, n);
+	
+	// 2) rank the pixels of the initial pattern, from the last one down
+	for(uint16_t r = ones; r > 0; r--){
+		uint16_t cluster = vc.tightestCluster();
+		vc.splat(cluster, false);
+		rank[cluster] = r - 1;
+	}
+	
+	// 3) back to the initial pattern, and rank every other pixel
+	memset(vc.energy, 0, n * sizeof(uint32_t));
+	for(uint16_t p = 0; p < n; p++){
+		if(initial[p])  vc.splat(p, true);
+	}
+	for(uint16_t r = ones; r < n; r++){
+		uint16_t hole = vc.largestVoid();
+		vc.splat(hole, true);
+		rank[hole] = r;
+	}
+	
+	free(vc.set);
+	free(vc.energy);
+	free(initial);
+	return 0;
+}
+
+// Allocates the tiled rows of a matrix of the given size
+static int8_t _matrixAlloc(_DitherMatrix &m, uint8_t size){
+	m.size = size;
+	m.tile = ((_point_chunk + size - 1) / size) * size;
+	m.cells = (uint8_t *)malloc((uint32_t)size * m.tile);
+	return (m.cells == NULL)?  -1 : 0;
+}
+
+// Repeats the first "size" thresholds of each row along its tiled row
+static void _matrixTile(_DitherMatrix &m){
+	for(uint8_t y = 0; y < m.size; y++){
+		uint8_t *dst = m.cells + (uint32_t)y * m.tile;
+		for(uint16_t x = m.size; x < m.tile; x++)  dst[x] = dst[x - m.size];
+	}
+}
+
+// Fills the tiled rows: rank r of size^2 becomes threshold 1 + r * 255 / size^2, so gray 0 sets no pixel, gray 255 sets them all
+// and, in between, about gray * size^2 / 255 pixels of each tile are set.
+static int8_t _matrixBuild(_DitherMatrix &m, uint8_t kind, uint8_t size){
+	uint16_t *rank = (uint16_t *)malloc((uint16_t)size * size * sizeof(uint16_t));
+	if(rank == NULL)  return -1;
+	
+	int8_t res = 0;
+	if(kind == DITHER_MATRIX_BAYER)  _bayerRanks(rank, size);
+	else if(kind == DITHER_MATRIX_CLUSTERED)  _clusteredRanks(rank, size);
+	else  res = _blueNoiseRanks(rank, size);
+	
+	if(res < 0  ||  _matrixAlloc(m, size) < 0){
+		free(rank);
+		return -1;		// not enough RAM
+	}
+	
+	const uint32_t levels = (uint32_t)size * size;
+	for(uint8_t y = 0; y < size; y++){
+		uint8_t *dst = m.cells + (uint32_t)y * m.tile;
+		for(uint8_t x = 0; x < size; x++)  dst[x] = 1 + ((uint32_t)rank[y * size + x] * 255) / levels;
+	}
+	_matrixTile(m);
+	free(rank);
+	
+	m.kind = kind;
+	return 0;
+}
+
+// Slot for a new matrix: an empty one if any, else one whose matrix is no longer used (which is freed). To be called with the lock held.
+static _DitherMatrix *_matrixFreeSlot(){
+	_DitherMatrix *unused = NULL;
+	for(uint8_t s = 0; s < _matrix_cache_slots; s++){
+		_DitherMatrix &m = _matrix_cache[s];
+		if(m.cells == NULL)  return &m;
+		if(unused == NULL  &&  m.users == 0)  unused = &m;
+	}
+	if(unused){
+		free(unused->cells);
+		unused->cells = NULL;
+	}
+	return unused;
+}
+
+_DitherMatrix *_matrixAcquire(uint8_t kind, uint8_t size){
+	
+	if(kind == DITHER_MATRIX_BAYER){
+		if(size < 2  ||  size > DITHER_MAX_PATTERN_SIZE  ||  !is_2s_pow(size))  return NULL;		// recursive Bayer matrices only exist for powers of 2
+	}
+	else if(kind == DITHER_MATRIX_CLUSTERED){
+		if(size < 2  ||  size > DITHER_MAX_PATTERN_SIZE)  return NULL;
+	}
+	else if(kind == DITHER_MATRIX_BLUE_NOISE){
+		if(size < 4  ||  size > DITHER_MAX_NOISE_SIZE)  return NULL;
+	}
+	else  return NULL;
+	
+	_matrixLock();
+	for(uint8_t s = 0; s < _matrix_cache_slots; s++){
+		_DitherMatrix &m = _matrix_cache[s];
+		if(m.cells  &&  m.kind == kind  &&  m.size == size){		// already built
+			_DitherMatrix *matrix = NULL;
+			if(m.users < _matrix_max_users){		// a wrapped count would let the matrix be freed while still in use
+				m.users++;
+				matrix = &m;
+			}
+			_matrixUnlock();
+			return matrix;
+		}
+	}
+	
+	_DitherMatrix *slot = _matrixFreeSlot();
+	if(slot){
+		if(_matrixBuild(*slot, kind, size) == 0)  slot->users = 1;
+		else  slot = NULL;
+	}
+	_matrixUnlock();
+	return slot;
+}
+
+_DitherMatrix *_matrixAdopt(const uint8_t *values, uint8_t size){
+	
+	if(size < 2  ||  size > _max_matrix_tile)  return NULL;
+	
+	_matrixLock();
+	_DitherMatrix *slot = _matrixFreeSlot();
+	if(slot  &&  _matrixAlloc(*slot, size) == 0){
+		for(uint8_t y = 0; y < size; y++){
+			uint8_t *dst = slot->cells + (uint32_t)y * slot->tile;
+			for(uint8_t x = 0; x < size; x++){
+				uint8_t v = values[(uint16_t)y * size + x];
+				dst[x] = (v == 255)?  255 : v + 1;
+			}
+		}
+		_matrixTile(*slot);
+		slot->kind = _matrix_loaded;
+		slot->users = 1;
+	}
+	else  slot = NULL;
+	_matrixUnlock();
+	return slot;
+}
+
+void _matrixRelease(_DitherMatrix *matrix){
+	if(matrix == NULL)  return;
+	_matrixLock();
+	matrix->users--;
+	_matrixUnlock();
+}
+
+
+#if DITHER_FILE_IO
+
+#include <stdio.h>
+
+// Reads the next number of a PGM header, skipping white space and comments
+static int32_t _pgmNumber(FILE *f){
+	int c = fgetc(f);
+	while(c == '#'  ||  c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n'){
+		if(c == '#'){
+			while(c != '\n'  &&  c != EOF)  c = fgetc(f);
+		}
+		c = fgetc(f);
+	}
+	int32_t v = -1;
+	for(; c >= '0'  &&  c <= '9'; c = fgetc(f))  v = ((v < 0)? 0 : v * 10) + (c - '0');
+	return v;		// the single white space after the number has been consumed, as PGM requires before the pixel data
+}
+
+int8_t Dither::loadPattern(const char *pgm_path){
+	
+	FILE *f = fopen(pgm_path, "rb");
+	if(f == NULL)  return -1;
+	
+	int32_t w = -1, h = -1, maxval = -1;
+	if(fgetc(f) == 'P'  &&  fgetc(f) == '5'){
+		w = _pgmNumber(f);
+		h = _pgmNumber(f);
+		maxval = _pgmNumber(f);
+	}
+	if(w < 2  ||  w != h  ||  w > _max_matrix_tile  ||  maxval < 1  ||  maxval > 255){
+		fclose(f);
+		return -1;		// not a square, 8 bit PGM of a valid size
+	}
+	
+	uint8_t *values = (uint8_t *)malloc(w * h);
+	bool ok = (values != NULL)  &&  (fread(values, 1, w * h, f) == (size_t)(w * h));
+	fclose(f);
+	if(ok  &&  maxval != 255){
+		for(int32_t p = 0; p < w * h; p++)  values[p] = (values[p] * 255) / maxval;
+	}
+	
+	_DitherMatrix *m = ok?  _matrixAdopt(values, w) : NULL;
+	free(values);
+	if(m == NULL)  return -1;
+	
+	_matrixRelease(_matrix);
+	_matrix = m;
+	_frame_primed = false;
+	return 0;
+}
+
+int8_t Dither::savePattern(const char *pgm_path){
+	
+	if(_matrix == NULL)  return -1;		// no matrix in use
+	FILE *f = fopen(pgm_path, "wb");
+	if(f == NULL)  return -1;
+	
+	const _DitherMatrix &m = *_matrix;
+	bool ok = fprintf(f, "P5\n%u %u\n255\n", m.size, m.size) > 0;
+	for(uint8_t y = 0; y < m.size  &&  ok; y++){
+		uint8_t values[_max_matrix_tile];
+		const uint8_t *row = m.row(y);
+		for(uint8_t x = 0; x < m.size; x++)  values[x] = row[x] - 1;		// thresholds are stored as values + 1
+		ok = fwrite(values, 1, m.size, f) == m.size;
+	}
+	return (fclose(f) == 0  &&  ok)?  0 : -1;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/********************************************************************************
+Threshold matrices used by patternDither (ordered dithering and blue noise),
+generated at runtime and shared by every Dither object through a small cache.
+This header is internal to the library: sketches only need "Dither.h".
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#ifndef DITHER_MATRIX_H
+#define DITHER_MATRIX_H
+
+#include <stdint.h>
+
+#define _matrix_cache_slots  8		// matrices (kind, size) kept in RAM at the same time
+#define _max_matrix_tile   128		// longest tiled row: a multiple of the matrix size, and at least _point_chunk long
+#define _matrix_loaded     0xFF		// kind of the matrices read from files: never shared, since two files may have the same size
+#define _matrix_max_users  0xFFFF	// users a matrix can count: no more can acquire it
+
+struct _DitherMatrix{
+	uint8_t kind;				// DITHER_MATRIX_BAYER, DITHER_MATRIX_CLUSTERED, DITHER_MATRIX_BLUE_NOISE or _matrix_loaded
+	uint8_t size;				// the matrix is size x size
+	uint16_t tile;			// length of the tiled rows
+	uint16_t users;			// Dither objects currently using the matrix; unused matrices stay cached until their slot is needed
+	uint8_t *cells;			// size rows of "tile" thresholds, each matrix row repeated along its tiled row; a pixel is set when it is >= its threshold (1 to 255)
+
+	inline const uint8_t *row(uint16_t y) const{
+		return cells + (uint32_t)(y % size) * tile;
+	}
+};
+
+_DitherMatrix *_matrixAcquire(uint8_t kind, uint8_t size);		// NULL if the size is not valid for that kind, on lack of RAM, or if the matrix already has _matrix_max_users users
+_DitherMatrix *_matrixAdopt(const uint8_t *values, uint8_t size);		// stores a size x size matrix of values (0 to 255) not shared with anyone; thresholds are values + 1
+void _matrixRelease(_DitherMatrix *matrix);
+
+#endif
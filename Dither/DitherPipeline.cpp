@@ -0,0 +1,282 @@
+/********************************************************************************
+Frame pipeline for the Dither library: a ring of frame slots between the
+caller (drawing frames), a dither stage and a sink stage (sending them),
+each on a thread of its own, so that the three overlap.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "Dither.h"
+
+#if DITHER_THREADS
+	#include <thread>
+	#include <mutex>
+	#include <condition_variable>
+#endif
+#include <new>
+
+#if DITHER_THREADS  ||  !defined(ARDUINO)
+	#include <chrono>
+
+	static uint32_t _pipelineMicros(){
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+#else
+	#define _pipelineMicros()  micros()
+#endif
+
+#define _pipeline_max_slots  8
+
+struct _PipelineSlot{
+	uint8_t *frame;					// width * height gray bytes, dithered in place
+	uint8_t *packed;				// packed output, or NULL (DITHER_OUT_BYTES)
+	uint32_t submit_us;
+	int8_t status;					// result of the dither stage
+};
+
+/*
+	Frame f goes through the slot f % count. Each stage only counts the frames it has done, so a slot is free again once the sink has
+	released it: acquired - released < count. All the counters are read and written under the lock; the slots themselves are not,
+	since a slot belongs to a single stage at a time.
+*/
+struct _PipelineState{
+	Dither *dither;
+	DitherSinkCallback sink;
+	void *user;
+	uint8_t algorithm, quantization_bits;
+	uint8_t out_format;
+	uint32_t out_stride, out_bytes, frame_bytes;
+
+	uint8_t count;
+	_PipelineSlot slots[_pipeline_max_slots];
+	uint32_t acquired, submitted, dithered, released;
+	bool stopping;
+	DitherPipelineStats stats;
+
+	#if DITHER_THREADS
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread dither_stage, sink_stage;
+	#endif
+
+	void ditherSlot(_PipelineSlot &slot, uint32_t &time_us){
+		uint32_t start = _pipelineMicros();
+		dither->setOutput(slot.packed, out_format, out_stride);
+		slot.status = dither->dither(slot.frame, algorithm, quantization_bits);
+		time_us = _pipelineMicros() - start;
+	}
+
+	void sinkSlot(_PipelineSlot &slot, uint32_t frame, uint32_t &time_us){
+		uint32_t start = _pipelineMicros();
+		if(slot.status == 0){
+			if(slot.packed)  sink(slot.packed, out_bytes, frame, user);
+			else  sink(slot.frame, frame_bytes, frame, user);
+		}
+		time_us = _pipelineMicros() - start;
+	}
+
+	// Counters of a dithered (then of a released) frame
+	void ditherDone(uint32_t time_us){
+		stats.dither_us = time_us;
+		if(time_us > stats.dither_max_us)  stats.dither_max_us = time_us;
+		stats.dither_total_us += time_us;
+	}
+
+	void sinkDone(const _PipelineSlot &slot, uint32_t time_us){
+		if(slot.status < 0){
+			stats.errors++;
+			return;
+		}
+		stats.frames++;
+		stats.sink_us = time_us;
+		if(time_us > stats.sink_max_us)  stats.sink_max_us = time_us;
+		stats.sink_total_us += time_us;
+		stats.latency_us = _pipelineMicros() - slot.submit_us;
+		if(stats.latency_us > stats.latency_max_us)  stats.latency_max_us = stats.latency_us;
+	}
+
+	#if DITHER_THREADS
+	void ditherLoop(){
+		while(true){
+			uint32_t f;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&]{ return dithered != submitted  ||  stopping; });
+				if(dithered == submitted)  return;		// stopping, and nothing left
+				f = dithered;
+			}
+			uint32_t time_us;
+			ditherSlot(slots[f % count], time_us);
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				ditherDone(time_us);
+				dithered++;
+			}
+			changed.notify_all();
+		}
+	}
+
+	void sinkLoop(){
+		while(true){
+			uint32_t f;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&]{ return released != dithered  ||  (stopping  &&  released == submitted); });
+				if(released == dithered)  return;
+				f = released;
+			}
+			uint32_t time_us;
+			sinkSlot(slots[f % count], f, time_us);
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				sinkDone(slots[f % count], time_us);
+				released++;
+			}
+			changed.notify_all();
+		}
+	}
+	#endif
+};
+
+
+DitherPipeline::~DitherPipeline(){
+	end();
+}
+
+int8_t DitherPipeline::begin(Dither &dither, DitherSinkCallback sink, void *user, uint8_t algorithm, uint8_t quantization_bits,
+														 uint8_t slots, uint8_t out_format, uint32_t out_stride){
+	end();
+	if(sink == NULL  ||  slots < 2  ||  slots > _pipeline_max_slots  ||  quantization_bits < 1  ||  quantization_bits > 7)  return -1;
+	if(dither.getWidth() == 0  ||  dither.getHeight() == 0)  return -1;
+	#if !DITHER_THREADS
+	slots = 1;		// the stages run one after the other
+	#endif
+
+	_PipelineState *p = new (std::nothrow) _PipelineState;
+	if(p == NULL)  return -1;		// not enough RAM
+	p->dither = &dither;
+	p->sink = sink;
+	p->user = user;
+	p->algorithm = algorithm;
+	p->quantization_bits = quantization_bits;
+	p->out_format = out_format;
+	p->out_stride = out_stride;
+	p->frame_bytes = (uint32_t)dither.getWidth() * dither.getHeight();
+	p->out_bytes = (out_format == DITHER_OUT_BYTES)?  0 : dither.outputSize(out_format, out_stride, quantization_bits);
+	p->count = slots;
+	p->acquired = p->submitted = p->dithered = p->released = 0;
+	p->stopping = false;
+	memset(&p->stats, 0, sizeof(p->stats));
+
+	bool ok = true;
+	for(uint8_t s = 0; s < slots; s++){
+		p->slots[s].frame = (uint8_t *)malloc(p->frame_bytes);
+		p->slots[s].packed = (p->out_bytes)?  (uint8_t *)malloc(p->out_bytes) : NULL;
+		ok = ok  &&  p->slots[s].frame  &&  (p->slots[s].packed  ||  p->out_bytes == 0);
+	}
+	_state = p;
+	if(!ok){
+		end();
+		return -1;
+	}
+
+	#if DITHER_THREADS
+	p->dither_stage = std::thread(&_PipelineState::ditherLoop, p);
+	p->sink_stage = std::thread(&_PipelineState::sinkLoop, p);
+	#endif
+	return 0;
+}
+
+uint8_t *DitherPipeline::acquireFrame(bool wait){
+	_PipelineState *p = _state;
+	if(p == NULL)  return NULL;
+
+	#if DITHER_THREADS
+	std::unique_lock<std::mutex> guard(p->lock);
+	if(p->acquired == p->submitted){		// else: the frame acquired last was not submitted yet, and is given again
+		if(p->acquired - p->released >= p->count){
+			if(!wait){
+				p->stats.dropped++;
+				return NULL;
+			}
+			uint32_t start = _pipelineMicros();
+			p->changed.wait(guard, [&]{ return p->acquired - p->released < p->count; });
+			p->stats.wait_us += _pipelineMicros() - start;
+		}
+		p->acquired++;
+	}
+	#else
+	(void)wait;		// a single slot, always free between two frames
+	if(p->acquired == p->submitted)  p->acquired++;
+	#endif
+	return p->slots[(p->acquired - 1) % p->count].frame;
+}
+
+int8_t DitherPipeline::submitFrame(){
+	_PipelineState *p = _state;
+	if(p == NULL)  return -1;
+
+	#if DITHER_THREADS
+	{
+		std::lock_guard<std::mutex> guard(p->lock);
+		if(p->acquired == p->submitted)  return -1;		// no frame acquired
+		p->slots[p->submitted % p->count].submit_us = _pipelineMicros();
+		p->submitted++;
+	}
+	p->changed.notify_all();
+	return 0;
+	#else
+	if(p->acquired == p->submitted)  return -1;
+	_PipelineSlot &slot = p->slots[0];
+	uint32_t time_us;
+	slot.submit_us = _pipelineMicros();
+	p->submitted++;
+	p->ditherSlot(slot, time_us);
+	p->ditherDone(time_us);
+	p->dithered++;
+	p->sinkSlot(slot, p->released, time_us);
+	p->sinkDone(slot, time_us);
+	p->released++;
+	return slot.status;
+	#endif
+}
+
+void DitherPipeline::end(){
+	_PipelineState *p = _state;
+	if(p == NULL)  return;
+
+	#if DITHER_THREADS
+	{
+		std::lock_guard<std::mutex> guard(p->lock);
+		p->stopping = true;
+	}
+	p->changed.notify_all();
+	if(p->dither_stage.joinable())  p->dither_stage.join();		// both stages finish the frames already submitted first
+	if(p->sink_stage.joinable())  p->sink_stage.join();
+	#endif
+
+	p->dither->setOutput(NULL);
+	for(uint8_t s = 0; s < p->count; s++){
+		free(p->slots[s].frame);
+		free(p->slots[s].packed);
+	}
+	delete p;
+	_state = NULL;
+}
+
+void DitherPipeline::getStats(DitherPipelineStats &stats){
+	_PipelineState *p = _state;
+	if(p == NULL){
+		memset(&stats, 0, sizeof(stats));
+		return;
+	}
+	#if DITHER_THREADS
+	std::lock_guard<std::mutex> guard(p->lock);
+	#endif
+	stats = p->stats;
+}
@@ -0,0 +1,387 @@
+/********************************************************************************
+Row primitives used by the point-operation algorithms and by the source
+decoders, with SIMD versions (SSE2, SSSE3, AVX2, AVX-512BW, NEON) chosen at
+runtime; see DitherSIMD.h.
+Every version gives the same output as the scalar one.
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <string.h>
+#include "DitherSIMD.h"
+
+#if DITHER_SIMD
+	#if defined(__x86_64__) || defined(__i386__)
+		#include <immintrin.h>
+		#define _simd_x86  1
+	#else
+		#include <arm_neon.h>
+		#define _simd_neon  1
+	#endif
+#endif
+
+
+// Scalar versions (always available)
+
+static void _thresholdRowScalar(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask){
+	for(uint32_t i = 0; i < n; i++){
+		dst[i] = ((src[i] >= thresh)?  0xFF : 0x00) ^ out_mask;
+	}
+}
+
+static void _compareRowScalar(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask){
+	for(uint32_t i = 0; i < n; i++){
+		dst[i] = (((src[i] >= thresh[i])?  0xFF : 0x00) & keep[i]) ^ out_mask;
+	}
+}
+
+static void _levelRowScalar(const uint8_t *src, uint8_t *dst, const uint8_t *offs, uint32_t n, uint8_t step, uint8_t out_mask){
+	const uint32_t recip = 65536 / step + 1;
+	for(uint32_t i = 0; i < n; i++){
+		uint16_t x = src[i] + offs[i];
+		if(x > 255)  x = 255;
+		dst[i] = (((x * recip) >> 16) * step) ^ out_mask;
+	}
+}
+
+static inline uint8_t _lumaOf(uint16_t r, uint16_t g, uint16_t b, const _DitherLuma &luma){
+	return ((uint32_t)(uint16_t)(r * luma.r + g * luma.g + b * luma.b + luma.bias) * luma.scale) >> 16;
+}
+
+static void _luma888Scalar(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	for(uint32_t i = 0; i < n; i++, src += 3)  dst[i] = _lumaOf(src[0], src[1], src[2], luma);
+}
+
+// Channels are expanded to 8 bit as color565To888 does: shifted left, the top value giving 255
+static void _luma565Scalar(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	for(uint32_t i = 0; i < n; i++){
+		uint16_t c;
+		memcpy(&c, src + 2 * i, 2);
+		uint16_t r = c >> 11, g = (c >> 5) & 0x3F, b = c & 0x1F;
+		r = (r == 0x1F)?  255 : r << 3;
+		g = (g == 0x3F)?  255 : g << 2;
+		b = (b == 0x1F)?  255 : b << 3;
+		dst[i] = _lumaOf(r, g, b, luma);
+	}
+}
+
+
+#if defined(_simd_x86)
+
+// Unsigned "a >= b" is computed as max(a, b) == a, since SSE2 and AVX2 lack unsigned byte comparisons.
+// The AVX2 functions hand their last pixels to the SSE2 ones, which are not VEX encoded: _mm256_zeroupper() comes first, otherwise every
+// SSE instruction from there on (in the caller too) pays the AVX to SSE transition penalty. The AVX-512 ones finish with a masked tail.
+
+__attribute__((target("sse2")))
+static void _thresholdRowSSE2(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask){
+	const __m128i t = _mm_set1_epi8((char)thresh), m = _mm_set1_epi8((char)out_mask);
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(p, t), p);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(ge, m));
+	}
+	_thresholdRowScalar(src + i, dst + i, n - i, thresh, out_mask);
+}
+
+__attribute__((target("sse2")))
+static void _compareRowSSE2(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask){
+	const __m128i m = _mm_set1_epi8((char)out_mask);
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i t = _mm_loadu_si128((const __m128i *)(thresh + i));
+		__m128i k = _mm_loadu_si128((const __m128i *)(keep + i));
+		__m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(p, t), p);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_and_si128(ge, k), m));
+	}
+	_compareRowScalar(src + i, dst + i, thresh + i, keep + i, n - i, out_mask);
+}
+
+// Levels of 8 pixels, from their saturated sums in 16 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i _level8SSE2(__m128i x, __m128i recip, __m128i step){
+	return _mm_mullo_epi16(_mm_mulhi_epu16(x, recip), step);
+}
+
+__attribute__((target("sse2")))
+static void _levelRowSSE2(const uint8_t *src, uint8_t *dst, const uint8_t *offs, uint32_t n, uint8_t step, uint8_t out_mask){
+	const __m128i recip = _mm_set1_epi16((short)(65536 / step + 1)), s = _mm_set1_epi16(step), m = _mm_set1_epi8((char)out_mask), zero = _mm_setzero_si128();
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		__m128i x = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + i)), _mm_loadu_si128((const __m128i *)(offs + i)));
+		__m128i lo = _level8SSE2(_mm_unpacklo_epi8(x, zero), recip, s), hi = _level8SSE2(_mm_unpackhi_epi8(x, zero), recip, s);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_packus_epi16(lo, hi), m));
+	}
+	_levelRowScalar(src + i, dst + i, offs + i, n - i, step, out_mask);
+}
+
+// Luma of 8 pixels, from their channels in 16 bit lanes (the weighted sum wraps around as the scalar one does)
+__attribute__((target("sse2")))
+static inline __m128i _lumaSSE2(__m128i r, __m128i g, __m128i b, const _DitherLuma &luma){
+	__m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(luma.r)), _mm_mullo_epi16(g, _mm_set1_epi16(luma.g)));
+	y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(luma.b)), _mm_set1_epi16(luma.bias)));
+	return _mm_mulhi_epu16(y, _mm_set1_epi16(luma.scale));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i _luma565x8SSE2(__m128i c, const _DitherLuma &luma){
+	const __m128i m5 = _mm_set1_epi16(0x1F), m6 = _mm_set1_epi16(0x3F);
+	__m128i r = _mm_srli_epi16(c, 11), g = _mm_and_si128(_mm_srli_epi16(c, 5), m6), b = _mm_and_si128(c, m5);
+	r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_and_si128(_mm_cmpeq_epi16(r, m5), _mm_set1_epi16(7)));
+	g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_and_si128(_mm_cmpeq_epi16(g, m6), _mm_set1_epi16(3)));
+	b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_and_si128(_mm_cmpeq_epi16(b, m5), _mm_set1_epi16(7)));
+	return _lumaSSE2(r, g, b, luma);
+}
+
+__attribute__((target("sse2")))
+static void _luma565SSE2(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		__m128i lo = _luma565x8SSE2(_mm_loadu_si128((const __m128i *)(src + 2 * i)), luma);
+		__m128i hi = _luma565x8SSE2(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), luma);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	_luma565Scalar(src + 2 * i, dst + i, n - i, luma);
+}
+
+// RGB888: the R, G and B bytes of 16 pixels (48 bytes, in 3 vectors) are gathered by byte shuffles, one mask per vector and channel
+__attribute__((target("ssse3")))
+static void _luma888SSSE3(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	uint8_t masks[3][3][16];		// [channel][source vector][byte]: index of the byte to take, or 0x80 for none
+	for(uint8_t k = 0; k < 3; k++){
+		for(uint8_t v = 0; v < 3; v++){
+			for(uint8_t p = 0; p < 16; p++)  masks[k][v][p] = ((3 * p + k) / 16 == v)?  (3 * p + k) % 16 : 0x80;
+		}
+	}
+	__m128i m[3][3];
+	for(uint8_t k = 0; k < 3; k++){
+		for(uint8_t v = 0; v < 3; v++)  m[k][v] = _mm_loadu_si128((const __m128i *)masks[k][v]);
+	}
+	
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		const uint8_t *s = src + 3 * i;
+		__m128i a = _mm_loadu_si128((const __m128i *)s), b = _mm_loadu_si128((const __m128i *)(s + 16)), c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i ch[3];
+		for(uint8_t k = 0; k < 3; k++){
+			ch[k] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[k][0]), _mm_shuffle_epi8(b, m[k][1])), _mm_shuffle_epi8(c, m[k][2]));
+		}
+		__m128i lo = _lumaSSE2(_mm_unpacklo_epi8(ch[0], zero), _mm_unpacklo_epi8(ch[1], zero), _mm_unpacklo_epi8(ch[2], zero), luma);
+		__m128i hi = _lumaSSE2(_mm_unpackhi_epi8(ch[0], zero), _mm_unpackhi_epi8(ch[1], zero), _mm_unpackhi_epi8(ch[2], zero), luma);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	_luma888Scalar(src + 3 * i, dst + i, n - i, luma);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i _luma565x16AVX2(__m256i c, const _DitherLuma &luma){
+	const __m256i m5 = _mm256_set1_epi16(0x1F), m6 = _mm256_set1_epi16(0x3F);
+	__m256i r = _mm256_srli_epi16(c, 11), g = _mm256_and_si256(_mm256_srli_epi16(c, 5), m6), b = _mm256_and_si256(c, m5);
+	r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_and_si256(_mm256_cmpeq_epi16(r, m5), _mm256_set1_epi16(7)));
+	g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_and_si256(_mm256_cmpeq_epi16(g, m6), _mm256_set1_epi16(3)));
+	b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_and_si256(_mm256_cmpeq_epi16(b, m5), _mm256_set1_epi16(7)));
+	__m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(luma.r)), _mm256_mullo_epi16(g, _mm256_set1_epi16(luma.g)));
+	y = _mm256_add_epi16(y, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(luma.b)), _mm256_set1_epi16(luma.bias)));
+	return _mm256_mulhi_epu16(y, _mm256_set1_epi16(luma.scale));
+}
+
+__attribute__((target("avx2")))
+static void _luma565AVX2(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32){
+		__m256i lo = _luma565x16AVX2(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), luma);
+		__m256i hi = _luma565x16AVX2(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 32)), luma);
+		__m256i y = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);		// packus works within 128 bit lanes
+		_mm256_storeu_si256((__m256i *)(dst + i), y);
+	}
+	_mm256_zeroupper();
+	_luma565SSE2(src + 2 * i, dst + i, n - i, luma);
+}
+
+// Unpacking and packing both work within 128 bit lanes, so the pixels come back in order
+__attribute__((target("avx2")))
+static void _levelRowAVX2(const uint8_t *src, uint8_t *dst, const uint8_t *offs, uint32_t n, uint8_t step, uint8_t out_mask){
+	const __m256i recip = _mm256_set1_epi16((short)(65536 / step + 1)), s = _mm256_set1_epi16(step), m = _mm256_set1_epi8((char)out_mask), zero = _mm256_setzero_si256();
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32){
+		__m256i x = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)(src + i)), _mm256_loadu_si256((const __m256i *)(offs + i)));
+		__m256i lo = _mm256_mullo_epi16(_mm256_mulhi_epu16(_mm256_unpacklo_epi8(x, zero), recip), s);
+		__m256i hi = _mm256_mullo_epi16(_mm256_mulhi_epu16(_mm256_unpackhi_epi8(x, zero), recip), s);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_packus_epi16(lo, hi), m));
+	}
+	_mm256_zeroupper();
+	_levelRowSSE2(src + i, dst + i, offs + i, n - i, step, out_mask);
+}
+
+__attribute__((target("avx2")))
+static void _thresholdRowAVX2(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask){
+	const __m256i t = _mm256_set1_epi8((char)thresh), m = _mm256_set1_epi8((char)out_mask);
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32){
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(p, t), p);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(ge, m));
+	}
+	_mm256_zeroupper();
+	_thresholdRowSSE2(src + i, dst + i, n - i, thresh, out_mask);
+}
+
+__attribute__((target("avx2")))
+static void _compareRowAVX2(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask){
+	const __m256i m = _mm256_set1_epi8((char)out_mask);
+	uint32_t i = 0;
+	for(; i + 32 <= n; i += 32){
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i t = _mm256_loadu_si256((const __m256i *)(thresh + i));
+		__m256i k = _mm256_loadu_si256((const __m256i *)(keep + i));
+		__m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(p, t), p);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_and_si256(ge, k), m));
+	}
+	_mm256_zeroupper();
+	_compareRowSSE2(src + i, dst + i, thresh + i, keep + i, n - i, out_mask);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void _thresholdRowAVX512(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask){
+	const __m512i t = _mm512_set1_epi8((char)thresh), m = _mm512_set1_epi8((char)out_mask);
+	for(uint32_t i = 0; i < n; i += 64){
+		__mmask64 live = (n - i >= 64)?  ~(__mmask64)0 : ((__mmask64)1 << (n - i)) - 1;		// the last pixels, if fewer than 64
+		__m512i p = _mm512_maskz_loadu_epi8(live, (const void *)(src + i));
+		__m512i ge = _mm512_movm_epi8(_mm512_cmpge_epu8_mask(p, t));
+		_mm512_mask_storeu_epi8((void *)(dst + i), live, _mm512_xor_si512(ge, m));
+	}
+	_mm256_zeroupper();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void _compareRowAVX512(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask){
+	const __m512i m = _mm512_set1_epi8((char)out_mask);
+	for(uint32_t i = 0; i < n; i += 64){
+		__mmask64 live = (n - i >= 64)?  ~(__mmask64)0 : ((__mmask64)1 << (n - i)) - 1;
+		__m512i p = _mm512_maskz_loadu_epi8(live, (const void *)(src + i));
+		__m512i t = _mm512_maskz_loadu_epi8(live, (const void *)(thresh + i));
+		__m512i k = _mm512_maskz_loadu_epi8(live, (const void *)(keep + i));
+		__m512i ge = _mm512_movm_epi8(_mm512_cmpge_epu8_mask(p, t));
+		_mm512_mask_storeu_epi8((void *)(dst + i), live, _mm512_xor_si512(_mm512_and_si512(ge, k), m));
+	}
+	_mm256_zeroupper();
+}
+
+#endif
+
+
+#if defined(_simd_neon)
+
+static void _thresholdRowNEON(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask){
+	const uint8x16_t t = vdupq_n_u8(thresh), m = vdupq_n_u8(out_mask);
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		uint8x16_t ge = vcgeq_u8(vld1q_u8(src + i), t);
+		vst1q_u8(dst + i, veorq_u8(ge, m));
+	}
+	_thresholdRowScalar(src + i, dst + i, n - i, thresh, out_mask);
+}
+
+static void _compareRowNEON(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask){
+	const uint8x16_t m = vdupq_n_u8(out_mask);
+	uint32_t i = 0;
+	for(; i + 16 <= n; i += 16){
+		uint8x16_t ge = vcgeq_u8(vld1q_u8(src + i), vld1q_u8(thresh + i));
+		vst1q_u8(dst + i, veorq_u8(vandq_u8(ge, vld1q_u8(keep + i)), m));
+	}
+	_compareRowScalar(src + i, dst + i, thresh + i, keep + i, n - i, out_mask);
+}
+
+static void _levelRowNEON(const uint8_t *src, uint8_t *dst, const uint8_t *offs, uint32_t n, uint8_t step, uint8_t out_mask){
+	const uint16_t recip = 65536 / step + 1;
+	const uint8x8_t m = vdup_n_u8(out_mask);
+	uint32_t i = 0;
+	for(; i + 8 <= n; i += 8){
+		uint16x8_t x = vmovl_u8(vqadd_u8(vld1_u8(src + i), vld1_u8(offs + i)));
+		uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(x), recip), 16), hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(x), recip), 16);
+		vst1_u8(dst + i, veor_u8(vmovn_u16(vmulq_n_u16(vcombine_u16(lo, hi), step)), m));
+	}
+	_levelRowScalar(src + i, dst + i, offs + i, n - i, step, out_mask);
+}
+
+// Luma of 8 pixels, from their channels in 16 bit lanes
+static inline uint8x8_t _lumaNEON(uint16x8_t r, uint16x8_t g, uint16x8_t b, const _DitherLuma &luma){
+	uint16x8_t y = vaddq_u16(vmlaq_n_u16(vmulq_n_u16(r, luma.r), g, luma.g), vmlaq_n_u16(vdupq_n_u16(luma.bias), b, luma.b));
+	uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(y), luma.scale), 16), hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(y), luma.scale), 16);
+	return vmovn_u16(vcombine_u16(lo, hi));
+}
+
+static void _luma888NEON(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	uint32_t i = 0;
+	for(; i + 8 <= n; i += 8){
+		uint8x8x3_t c = vld3_u8(src + 3 * i);		// de-interleaves R, G and B
+		vst1_u8(dst + i, _lumaNEON(vmovl_u8(c.val[0]), vmovl_u8(c.val[1]), vmovl_u8(c.val[2]), luma));
+	}
+	_luma888Scalar(src + 3 * i, dst + i, n - i, luma);
+}
+
+static void _luma565NEON(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma){
+	const uint16x8_t m5 = vdupq_n_u16(0x1F), m6 = vdupq_n_u16(0x3F);
+	uint32_t i = 0;
+	for(; i + 8 <= n; i += 8){
+		uint16x8_t c = vreinterpretq_u16_u8(vld1q_u8(src + 2 * i));
+		uint16x8_t r = vshrq_n_u16(c, 11), g = vandq_u16(vshrq_n_u16(c, 5), m6), b = vandq_u16(c, m5);
+		r = vorrq_u16(vshlq_n_u16(r, 3), vandq_u16(vceqq_u16(r, m5), vdupq_n_u16(7)));
+		g = vorrq_u16(vshlq_n_u16(g, 2), vandq_u16(vceqq_u16(g, m6), vdupq_n_u16(3)));
+		b = vorrq_u16(vshlq_n_u16(b, 3), vandq_u16(vceqq_u16(b, m5), vdupq_n_u16(7)));
+		vst1_u8(dst + i, _lumaNEON(r, g, b, luma));
+	}
+	_luma565Scalar(src + 2 * i, dst + i, n - i, luma);
+}
+
+#endif
+
+
+// Runtime dispatcher
+
+static _DitherRowOps _detectRowOps(){
+	_DitherRowOps ops = {_thresholdRowScalar, _compareRowScalar, _levelRowScalar, _luma888Scalar, _luma565Scalar, "scalar"};
+
+	#if defined(_simd_x86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")){
+		ops.thresholdRow = _thresholdRowSSE2;
+		ops.compareRow = _compareRowSSE2;
+		ops.levelRow = _levelRowSSE2;
+		ops.luma565 = _luma565SSE2;
+		ops.name = "sse2";
+	}
+	if(__builtin_cpu_supports("ssse3"))  ops.luma888 = _luma888SSSE3;
+	if(__builtin_cpu_supports("avx2")){
+		ops.thresholdRow = _thresholdRowAVX2;
+		ops.compareRow = _compareRowAVX2;
+		ops.levelRow = _levelRowAVX2;
+		ops.luma565 = _luma565AVX2;
+		ops.name = "avx2";
+	}
+	if(__builtin_cpu_supports("avx512bw")){
+		ops.thresholdRow = _thresholdRowAVX512;
+		ops.compareRow = _compareRowAVX512;
+		ops.name = "avx512bw";
+	}
+	#elif defined(_simd_neon)
+	ops.thresholdRow = _thresholdRowNEON;
+	ops.compareRow = _compareRowNEON;
+	ops.levelRow = _levelRowNEON;
+	ops.luma888 = _luma888NEON;
+	ops.luma565 = _luma565NEON;
+	ops.name = "neon";
+	#endif
+
+	return ops;
+}
+
+const _DitherRowOps &_ditherRowOps(){
+	static const _DitherRowOps ops = _detectRowOps();
+	return ops;
+}
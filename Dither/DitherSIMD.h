@@ -0,0 +1,54 @@
+/********************************************************************************
+Row primitives used by the point-operation algorithms (thresholding, pattern
+and random dithering) and by the source decoders, with SIMD versions picked
+at runtime.
+This header is internal to the library: sketches only need "Dither.h".
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#ifndef DITHER_SIMD_H
+#define DITHER_SIMD_H
+
+#include <stdint.h>
+
+// SIMD support: SSE2 / AVX2 / AVX-512 on x86 (GCC and Clang), NEON on ARM. Define DITHER_SIMD as 0 to only build the scalar code.
+#ifndef DITHER_SIMD
+  #if defined(__GNUC__)  &&  (defined(__x86_64__) || defined(__i386__) || defined(__ARM_NEON) || defined(__ARM_NEON__))
+    #define DITHER_SIMD  1
+  #else
+    #define DITHER_SIMD  0
+  #endif
+#endif
+
+#define _point_chunk  64		// pixels per call of the row primitives, when thresholds change along the row (multiple of every vector width)
+
+	// dst[i] = ((src[i] >= thresh)? 0xFF : 0x00) ^ out_mask
+typedef void (*_ThresholdRowFn)(const uint8_t *src, uint8_t *dst, uint32_t n, uint8_t thresh, uint8_t out_mask);
+	// dst[i] = (((src[i] >= thresh[i])? 0xFF : 0x00) & keep[i]) ^ out_mask			keep[i] == 0 makes the comparison always false
+typedef void (*_CompareRowFn)(const uint8_t *src, uint8_t *dst, const uint8_t *thresh, const uint8_t *keep, uint32_t n, uint8_t out_mask);
+
+	// dst[i] = ((min(src[i] + offs[i], 255) / step) * step) ^ out_mask			step >= 2; the division is ((x * (65536 / step + 1)) >> 16), exact for x <= 255
+typedef void (*_LevelRowFn)(const uint8_t *src, uint8_t *dst, const uint8_t *offs, uint32_t n, uint8_t step, uint8_t out_mask);
+
+// Luma of an 8 bit (R, G, B) color: ((R * r + G * g + B * b + bias) * scale) >> 16, every step within 16 bits (see setSource)
+struct _DitherLuma{
+	uint16_t r, g, b, bias, scale;
+};
+	// dst[i] = luma of pixel i of src, in DITHER_RGB888 (3 bytes per pixel) or DITHER_RGB565 (one uint16_t per pixel) format
+typedef void (*_LumaRowFn)(const uint8_t *src, uint8_t *dst, uint32_t n, const _DitherLuma &luma);
+
+struct _DitherRowOps{
+	_ThresholdRowFn thresholdRow;
+	_CompareRowFn compareRow;
+	_LevelRowFn levelRow;
+	_LumaRowFn luma888, luma565;
+	const char *name;		// "scalar", "sse2", "avx2", "avx512bw" or "neon"
+};
+
+const _DitherRowOps &_ditherRowOps();		// best implementation for the running CPU, detected on first call
+
+#endif
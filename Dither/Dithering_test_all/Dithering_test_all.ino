@@ -36,6 +36,7 @@ void setup(){
   Serial.println("Starting.");
   
   initDisplay();
+  image.setOutput(display.getBuffer(), DITHER_OUT_SSD1306, SCREEN_WIDTH);  // dithered pixels go straight into the display RAM buffer, no conversion pass needed
 
   uint32_t t = micros();
   loadImageBuffer();
@@ -69,6 +70,7 @@ void setup(){
     
     static uint8_t cnt = 0;
     loadImageBuffer();
+    display.clearDisplay();
 
     uint32_t t = micros();
     switch(cnt){
@@ -101,8 +103,6 @@ void setup(){
     cnt = (cnt + 1) % 15;
 
     
-    display.clearDisplay();
-    showImg(img_mod);
     display.display();
     
     delay(2000);    // 2 seconds between each dithering algorithm
@@ -116,21 +116,6 @@ void loop() {
 }
 
 
-void showImg(uint8_t *img){
-
-  for(uint16_t y = 0; y < img_height; y++){
-    for(uint16_t x = 0; x < img_width; x++){
-
-      uint8_t color = img[image.index(x, y)];
-
-      uint8_t pixel = image.colorGray256ToBool(color);
-
-      display.drawPixel(x, y, pixel);
-    }
-  }
-}
-
-
 void initDisplay(){
   display.begin(SSD1306_SWITCHCAPVCC, 0x3C);  // initialize with I2C addr 0x3C
   //display.dim(1); // dim the display
@@ -0,0 +1,503 @@
+/********************************************************************************
+Host benchmark for the Dither library: runs every public algorithm over a
+range of image sizes, contents and quantization levels, and reports Mpix/s,
+ns per pixel and peak memory, as a table and (optionally) as JSON.
+
+Build (from the library folder) both ways: with default flags, as the library is usually built (SIMD rows picked at runtime), and for the host CPU:
+	g++ -std=c++11 -O2 -pthread -I. extras/benchmark/dither_bench.cpp *.cpp -o dither_bench
+	g++ -std=c++11 -O2 -march=native -pthread -I. extras/benchmark/dither_bench.cpp *.cpp -o dither_bench_native
+
+Usage: dither_bench [options]
+	--quick                 sizes up to 1920x1080, quantization bits 1, 2 and 4
+	--sizes WxH,...         e.g. 128x32,640x480 (default: 128x32 up to 8192x8192)
+	--bits LIST             quantization bits for error diffusion, e.g. 1,4,7 or 1-7 (default)
+	--algorithms LIST       names as printed in the results (default: all)
+	--images LIST           synthetic images: gradient, noise, photo (default: all)
+	--pgm FILE              adds a real image (binary PGM, P5), tiled to every size; can be repeated
+	--threads N             setThreads(N) (default 1; 0: one per core)
+	--min-time SECONDS      time spent on each case, at least one run (default 0.25)
+	--json FILE             writes the results as JSON ("-": standard output, the table then goes to standard error)
+	--check                 checks the error diffusion kernels against the _GPEDDither reference (bits 1 to 7, inverted or not, 1 and 4
+	                        threads, odd and tiny sizes), and custom filters wider than the image, instead of measuring; exits with 1 on
+	                        any difference
+
+Copyright (c) 2021 Leopoldo Perizzolo - Deep Tronix
+Find me @ https://rebrand.ly/deeptronix
+
+Released under the MIT license; see Dither.h for the full text.
+********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Dither.h"
+#include "DitherSIMD.h"
+
+#if defined(__unix__)  ||  defined(__APPLE__)
+	#include <sys/resource.h>
+#endif
+
+struct _BenchAlgorithm{
+	const char *name;
+	uint8_t kind;					// 0: Dither::dither(), 1: patternDither with a given matrix, 2: randomDither without time consistency
+	uint8_t algorithm;		// DITHER_... algorithm (kind 0) or DITHER_MATRIX_... matrix (kind 1)
+	bool quantized;				// accepts quantization_bits > 1
+};
+
+static const _BenchAlgorithm _bench_algorithms[] = {
+	{"FSDither",                   0, DITHER_FS,         true},
+	{"JJNDither",                  0, DITHER_JJN,        true},
+	{"StuckiDither",               0, DITHER_STUCKI,     true},
+	{"BurkesDither",               0, DITHER_BURKES,     true},
+	{"Sierra3Dither",              0, DITHER_SIERRA3,    true},
+	{"Sierra2Dither",              0, DITHER_SIERRA2,    true},
+	{"Sierra24ADither",            0, DITHER_SIERRA24A,  true},
+	{"AtkinsonDither",             0, DITHER_ATKINSON,   true},
+	{"PersonalFilterDither",       0, DITHER_PERSONAL,   true},
+	{"fastEDDither",               0, DITHER_FAST_ED,    false},
+	{"thresholding",               0, DITHER_THRESHOLD,  false},
+	{"patternDither-bayer",        1, DITHER_MATRIX_BAYER,      true},
+	{"patternDither-clustered",    1, DITHER_MATRIX_CLUSTERED,  true},
+	{"patternDither-bluenoise",    1, DITHER_MATRIX_BLUE_NOISE, true},
+	{"randomDither",               0, DITHER_RANDOM,     false},
+	{"randomDither-frames",        2, 0,                 false},
+};
+
+#define _bench_gradient  0
+#define _bench_noise     1
+#define _bench_photo     2
+#define _bench_pgm       3
+static const char *_bench_synthetic[] = {"gradient", "noise", "photo"};
+
+struct _BenchImage{
+	std::string name;
+	uint8_t kind;							// _bench_gradient ... _bench_pgm
+	std::vector<uint8_t> pgm;		// real images only
+	uint32_t pgm_width, pgm_height;
+};
+
+struct _BenchResult{
+	const char *algorithm;
+	std::string image;
+	uint32_t width, height;
+	uint8_t quantization_bits;
+	uint32_t runs;
+	double ns_per_pixel, best_ns_per_pixel, mpix_per_s;
+	long peak_rss_kb, extra_kb;		// peak resident memory of the process during the case, and its growth over the one before the case
+};
+
+
+static double _benchSeconds(){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Peak resident memory: on Linux the peak is reset before each case (clear_refs), elsewhere it is the peak of the whole process
+static void _benchResetPeak(){
+	#if defined(__linux__)
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if(f){
+		fputs("5", f);
+		fclose(f);
+	}
+	#endif
+}
+
+static long _benchMemoryKB(const char *field){		// "VmHWM" (peak) or "VmRSS" (current)
+	#if defined(__linux__)
+	FILE *f = fopen("/proc/self/status", "r");
+	if(f){
+		char line[128];
+		long kb = -1;
+		size_t len = strlen(field);
+		while(fgets(line, sizeof(line), f)){
+			if(strncmp(line, field, len) == 0  &&  line[len] == ':'){
+				kb = atol(line + len + 1);
+				break;
+			}
+		}
+		fclose(f);
+		if(kb >= 0)  return kb;
+	}
+	#endif
+	#if defined(__unix__)  ||  defined(__APPLE__)
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0){
+		#if defined(__APPLE__)
+		return usage.ru_maxrss / 1024;		// bytes
+		#else
+		return usage.ru_maxrss;
+		#endif
+	}
+	#endif
+	(void)field;
+	return 0;
+}
+
+
+// Synthetic images: a horizontal ramp (banding), uniform noise (worst case for any predictor) and a smooth "photo-like" mix
+// of blobs, edges and a little grain. A fixed LCG keeps them the same from run to run.
+static void _benchFill(const _BenchImage &image, uint8_t *img, uint32_t width, uint32_t height){
+	uint32_t lcg = 12345;
+	for(uint32_t y = 0; y < height; y++){
+		for(uint32_t x = 0; x < width; x++){
+			lcg = lcg * 1664525 + 1013904223;
+			uint8_t v;
+			if(image.kind == _bench_pgm){
+				v = image.pgm[(y % image.pgm_height) * image.pgm_width + (x % image.pgm_width)];
+			}
+			else if(image.kind == _bench_gradient){
+				v = (width > 1)?  (uint64_t)x * 255 / (width - 1) : 128;
+			}
+			else if(image.kind == _bench_noise){
+				v = lcg >> 24;
+			}
+			else{		// photo
+				float u = (float)x / width, w = (float)y / height;
+				float s = 0.5 + 0.25 * sinf(6.3 * u + 2.0 * w) * cosf(4.1 * w - u) + 0.2 * sinf(25.0 * u * w);
+				if((u - 0.6) * (u - 0.6) + (w - 0.4) * (w - 0.4) < 0.03)  s = 0.9 - 0.5 * u;		// a disc with a sharp edge
+				int16_t g = s * 255 + (int8_t)(lcg >> 24) / 16;
+				v = (g < 0)?  0 : (g > 255)?  255 : g;
+			}
+			img[(uint64_t)y * width + x] = v;
+		}
+	}
+}
+
+static bool _benchLoadPGM(const char *path, _BenchImage &image){
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)  return false;
+	uint32_t w = 0, h = 0, maxval = 0;
+	char magic[3] = {0};
+	bool ok = fscanf(f, "%2s", magic) == 1  &&  strcmp(magic, "P5") == 0;
+	// Header fields, skipping comments
+	uint32_t *fields[3] = {&w, &h, &maxval};
+	for(uint8_t i = 0; ok  &&  i < 3; i++){
+		int c;
+		while((c = fgetc(f)) != EOF  &&  (c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n'  ||  c == '#')){
+			if(c == '#')  while((c = fgetc(f)) != EOF  &&  c != '\n');
+		}
+		ok = (c != EOF)  &&  ungetc(c, f) != EOF  &&  fscanf(f, "%u", fields[i]) == 1;
+	}
+	ok = ok  &&  w > 0  &&  h > 0  &&  maxval > 0  &&  maxval < 256  &&  fgetc(f) != EOF;
+	if(ok){
+		image.pgm.resize((size_t)w * h);
+		ok = fread(image.pgm.data(), 1, image.pgm.size(), f) == image.pgm.size();
+		image.pgm_width = w;
+		image.pgm_height = h;
+		image.kind = _bench_pgm;
+	}
+	fclose(f);
+	if(ok){
+		const char *base = strrchr(path, '/');
+		image.name = (base)?  base + 1 : path;
+	}
+	return ok;
+}
+
+
+// Runs a case as many times as min_time allows (at least once); the input is restored before each run, outside of the timing
+static bool _benchCase(const _BenchAlgorithm &a, const _BenchImage &image, uint32_t width, uint32_t height, uint8_t bits,
+											 uint8_t threads, double min_time, _BenchResult &res){
+
+	const size_t pixels = (size_t)width * height;
+	std::vector<uint8_t> source(pixels), work(pixels);
+	_benchFill(image, source.data(), width, height);
+	memcpy(work.data(), source.data(), pixels);		// pages of both buffers are resident before the case starts
+
+	Dither d(width, height);
+	d.setThreads(threads);
+	if(a.kind == 1){		// matrices are built (and cached) outside of the timing
+		int8_t built = (a.algorithm == DITHER_MATRIX_BAYER)?  d.buildBayerPattern() : (a.algorithm == DITHER_MATRIX_CLUSTERED)?  d.buildClusteredPattern() : d.buildBlueNoisePattern();
+		if(built < 0)  return false;
+	}
+
+	_benchResetPeak();
+	const long before_kb = _benchMemoryKB("VmRSS");
+	double total = 0, best = 1e30;
+	uint32_t runs = 0;
+	while(runs == 0  ||  total < min_time){
+		memcpy(work.data(), source.data(), pixels);
+		double t = _benchSeconds();
+		int8_t status;
+		if(a.kind == 0)  status = d.dither(work.data(), a.algorithm, bits);
+		else if(a.kind == 1)  status = d.patternDither(work.data(), 0, bits);
+		else  status = d.randomDither(work.data(), false);
+		t = _benchSeconds() - t;
+		if(status < 0)  return false;
+		total += t;
+		if(t < best)  best = t;
+		runs++;
+	}
+
+	res.algorithm = a.name;
+	res.image = image.name;
+	res.width = width;
+	res.height = height;
+	res.quantization_bits = bits;
+	res.runs = runs;
+	res.ns_per_pixel = total * 1e9 / runs / pixels;
+	res.best_ns_per_pixel = best * 1e9 / pixels;
+	res.mpix_per_s = 1e3 / res.ns_per_pixel;
+	res.peak_rss_kb = _benchMemoryKB("VmHWM");
+	res.extra_kb = (res.peak_rss_kb > before_kb)?  res.peak_rss_kb - before_kb : 0;
+	return true;
+}
+
+
+static std::vector<std::string> _benchSplit(const char *list){
+	std::vector<std::string> items;
+	std::string item;
+	for(const char *p = list; ; p++){
+		if(*p == ','  ||  *p == '\0'){
+			if(!item.empty())  items.push_back(item);
+			item.clear();
+			if(*p == '\0')  break;
+		}
+		else  item += *p;
+	}
+	return items;
+}
+
+static void _benchJSONString(FILE *f, const std::string &s){
+	fputc('"', f);
+	for(size_t i = 0; i < s.size(); i++){
+		unsigned char c = s[i];
+		if(c == '"'  ||  c == '\\')  fprintf(f, "\\%c", c);
+		else if(c < 0x20)  fprintf(f, "\\u%04x", c);
+		else  fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void _benchWriteJSON(FILE *f, const std::vector<_BenchResult> &results, uint8_t threads, double min_time){
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+	fprintf(f, "{\n  \"benchmark\": \"dither_bench\",\n  \"date\": \"%s\",\n", date);
+	#if defined(__VERSION__)
+	fprintf(f, "  \"compiler\": ");
+	_benchJSONString(f, __VERSION__);
+	fprintf(f, ",\n");
+	#endif
+	fprintf(f, "  \"row_ops\": \"%s\",\n  \"threads\": %u,\n  \"min_time_s\": %g,\n  \"results\": [", _ditherRowOps().name, threads, min_time);
+	for(size_t i = 0; i < results.size(); i++){
+		const _BenchResult &r = results[i];
+		fprintf(f, "%s\n    {\"algorithm\": \"%s\", \"image\": ", i? "," : "", r.algorithm);
+		_benchJSONString(f, r.image);
+		fprintf(f, ", \"width\": %u, \"height\": %u, \"quantization_bits\": %u, \"runs\": %u, \"ns_per_pixel\": %.4f, \"best_ns_per_pixel\": %.4f, "
+							 "\"mpix_per_s\": %.3f, \"peak_rss_kb\": %ld, \"extra_kb\": %ld}",
+							 r.width, r.height, r.quantization_bits, r.runs, r.ns_per_pixel, r.best_ns_per_pixel, r.mpix_per_s, r.peak_rss_kb, r.extra_kb);
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+
+// The error diffusion functions run compile-time kernels; _GPEDDither, which interprets the _filters[][] table, is the reference they must match
+struct _DitherReference{
+	static int8_t run(Dither &dither, uint8_t *image, uint8_t quantization_bits, uint8_t filter_index){
+		return dither._GPEDDither(image, quantization_bits, filter_index);
+	}
+};
+
+static int _benchCheck(){
+	static const uint16_t sizes[][2] = {{1, 1}, {1, 7}, {7, 1}, {2, 2}, {3, 5}, {5, 3}, {17, 9}, {63, 31}, {131, 67}, {1031, 9}};
+	uint32_t cases = 0, failed = 0;
+	srand(1);
+	for(const uint16_t *size : sizes){
+		const uint16_t w = size[0], h = size[1];
+		std::vector<uint8_t> source(w * h), kernel, reference;
+		for(uint32_t i = 0; i < source.size(); i++)  source[i] = (i & 1)?  rand() : (i % w) * 255 / w;		// noise over a gradient
+		for(uint8_t filter = FSf; filter <= PERf; filter++){
+			for(uint8_t bits = 1; bits <= 7; bits++){
+				for(uint8_t invert = 0; invert < 2; invert++){
+					for(uint8_t threads = 1; threads <= 4; threads += 3){
+						Dither dither(w, h, invert), ref(w, h, invert);
+						dither.setThreads(threads);
+						kernel = reference = source;
+						int8_t res = dither.dither(kernel.data(), filter, bits);		// DITHER_FS ... DITHER_PERSONAL are the filter numbers
+						int8_t ref_res = _DitherReference::run(ref, reference.data(), bits, filter);
+						cases++;
+						if(res != ref_res  ||  kernel != reference){
+							failed++;
+							fprintf(stderr, "filter %u, %ux%u, bits %u, invert %u, threads %u: differs from _GPEDDither\n", filter, w, h, bits, invert, threads);
+						}
+					}
+				}
+			}
+		}
+	}
+	printf("%u cases checked against _GPEDDither, %u failed\n", cases, failed);
+	
+	// Custom filter with a tap wider than the image (dx = -20): it must never write outside the image (guard bytes on both sides), and
+	// up to 10 columns, where it always reaches further left than a whole row and is dropped, the output is the one without it.
+	static const DitherTap fs[] = {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}, wide[] = {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}, {-20, 1, 1}};
+	static const uint16_t widths[] = {1, 2, 5, 10, 15, 19, 21, 40, 300};
+	const uint32_t guard = 64;
+	uint32_t wide_cases = 0, wide_failed = 0;
+	for(uint16_t w : widths){
+		const uint16_t h = 6;
+		std::vector<uint8_t> source(w * h);
+		for(uint32_t i = 0; i < source.size(); i++)  source[i] = rand();
+		for(uint8_t threads = 1; threads <= 4; threads += 3){
+			for(uint8_t tiles = 0; tiles <= 8; tiles += 8){
+				Dither dither(w, h), plain(w, h);
+				dither.setThreads(threads);
+				dither.setTiles(tiles);
+				plain.setTiles(tiles);
+				dither.setCustomFilter(wide, 5, 17);
+				plain.setCustomFilter(fs, 4, 17);
+				std::vector<uint8_t> buffer(guard + source.size() + guard, 0xA5), expected = source;
+				std::copy(source.begin(), source.end(), buffer.begin() + guard);
+				int8_t res = dither.dither(buffer.data() + guard, DITHER_CUSTOM);
+				plain.dither(expected.data(), DITHER_CUSTOM);
+				bool guarded = true;
+				for(uint32_t g = 0; g < guard; g++)  guarded = guarded  &&  buffer[g] == 0xA5  &&  buffer[guard + source.size() + g] == 0xA5;
+				wide_cases++;
+				if(res != 0  ||  !guarded  ||  (w <= 10  &&  !std::equal(expected.begin(), expected.end(), buffer.begin() + guard))){
+					wide_failed++;
+					fprintf(stderr, "custom filter wider than the image, %ux%u, threads %u, tiles %u: %s\n", w, h, threads, tiles,
+									(res != 0)?  "failed" : !guarded?  "writes outside the image" : "differs from the filter without that tap");
+				}
+			}
+		}
+	}
+	printf("%u cases of a custom filter wider than the image, %u failed\n", wide_cases, wide_failed);
+	return (failed  ||  wide_failed)?  1 : 0;
+}
+
+
+int main(int argc, char **argv){
+
+	std::vector<std::pair<uint32_t, uint32_t> > sizes = {{128, 32}, {320, 240}, {640, 480}, {1920, 1080}, {3840, 2160}, {7680, 4320}, {8192, 8192}};
+	std::vector<uint8_t> bits = {1, 2, 3, 4, 5, 6, 7};
+	std::vector<std::string> algorithms, image_names = {"gradient", "noise", "photo"};
+	std::vector<_BenchImage> images, pgm_images;
+	uint8_t threads = 1;
+	double min_time = 0.25;
+	const char *json_path = NULL;
+
+	for(int i = 1; i < argc; i++){
+		std::string opt = argv[i];
+		const char *val = (i + 1 < argc)?  argv[i + 1] : NULL;
+		if(opt == "--check")  return _benchCheck();
+		if(opt == "--quick"){
+			sizes = {{128, 32}, {640, 480}, {1920, 1080}};
+			bits = {1, 2, 4};
+			continue;
+		}
+		if(val == NULL){
+			fprintf(stderr, "unknown option or missing value: %s\n", argv[i]);
+			return 1;
+		}
+		i++;
+		if(opt == "--sizes"){
+			sizes.clear();
+			for(const std::string &s : _benchSplit(val)){
+				unsigned w, h;
+				if(sscanf(s.c_str(), "%ux%u", &w, &h) != 2  ||  w == 0  ||  h == 0  ||  w > 65535  ||  h > 65535){
+					fprintf(stderr, "bad size: %s\n", s.c_str());
+					return 1;
+				}
+				sizes.push_back(std::make_pair(w, h));
+			}
+		}
+		else if(opt == "--bits"){
+			bits.clear();
+			for(const std::string &s : _benchSplit(val)){
+				unsigned lo, hi;
+				int n = sscanf(s.c_str(), "%u-%u", &lo, &hi);
+				if(n == 1)  hi = lo;
+				if(n < 1  ||  lo < 1  ||  hi > 7  ||  lo > hi){
+					fprintf(stderr, "bad quantization bits: %s\n", s.c_str());
+					return 1;
+				}
+				for(unsigned b = lo; b <= hi; b++)  bits.push_back(b);
+			}
+		}
+		else if(opt == "--algorithms")  algorithms = _benchSplit(val);
+		else if(opt == "--images")  image_names = _benchSplit(val);
+		else if(opt == "--pgm"){
+			_BenchImage image;
+			if(!_benchLoadPGM(val, image)){
+				fprintf(stderr, "cannot read %s (binary PGM, 8 bit)\n", val);
+				return 1;
+			}
+			pgm_images.push_back(image);
+		}
+		else if(opt == "--threads")  threads = atoi(val);
+		else if(opt == "--min-time")  min_time = atof(val);
+		else if(opt == "--json")  json_path = val;
+		else{
+			fprintf(stderr, "unknown option: %s\n", opt.c_str());
+			return 1;
+		}
+	}
+	for(const std::string &name : image_names){
+		_BenchImage image;
+		image.name = name;
+		for(image.kind = 0; image.kind < _bench_pgm  &&  name != _bench_synthetic[image.kind]; image.kind++);
+		if(image.kind == _bench_pgm){
+			fprintf(stderr, "unknown image: %s\n", name.c_str());
+			return 1;
+		}
+		images.push_back(image);
+	}
+	images.insert(images.end(), pgm_images.begin(), pgm_images.end());
+	for(const std::string &name : algorithms){
+		bool found = false;
+		for(const _BenchAlgorithm &a : _bench_algorithms)  found = found  ||  name == a.name;
+		if(!found){
+			fprintf(stderr, "unknown algorithm: %s\n", name.c_str());
+			return 1;
+		}
+	}
+
+	FILE *table = (json_path  &&  strcmp(json_path, "-") == 0)?  stderr : stdout;
+	fprintf(table, "row ops: %s, threads: %u\n", _ditherRowOps().name, threads);
+	fprintf(table, "%-24s %-12s %11s %4s %6s %10s %10s %10s %10s\n", "algorithm", "image", "size", "bits", "runs", "ns/pixel", "best", "Mpix/s", "peak kB");
+
+	std::vector<_BenchResult> results;
+	for(const _BenchAlgorithm &a : _bench_algorithms){
+		if(!algorithms.empty()){
+			bool wanted = false;
+			for(const std::string &name : algorithms)  wanted = wanted  ||  name == a.name;
+			if(!wanted)  continue;
+		}
+		for(const _BenchImage &image : images){
+			for(const std::pair<uint32_t, uint32_t> &size : sizes){
+				for(uint8_t b : bits){
+					if(!a.quantized  &&  b != bits[0])  break;		// a single run, at 1 bit
+					_BenchResult r;
+					if(!_benchCase(a, image, size.first, size.second, a.quantized?  b : 1, threads, min_time, r)){
+						fprintf(stderr, "%s failed on %ux%u (not enough RAM?)\n", a.name, size.first, size.second);
+						continue;
+					}
+					char dims[16];
+					snprintf(dims, sizeof(dims), "%ux%u", r.width, r.height);
+					fprintf(table, "%-24s %-12.12s %11s %4u %6u %10.3f %10.3f %10.1f %10ld\n", r.algorithm, r.image.c_str(), dims,
+									r.quantization_bits, r.runs, r.ns_per_pixel, r.best_ns_per_pixel, r.mpix_per_s, r.peak_rss_kb);
+					fflush(table);
+					results.push_back(r);
+				}
+			}
+		}
+	}
+
+	if(json_path){
+		FILE *f = (strcmp(json_path, "-") == 0)?  stdout : fopen(json_path, "w");
+		if(f == NULL){
+			fprintf(stderr, "cannot write %s\n", json_path);
+			return 1;
+		}
+		_benchWriteJSON(f, results, threads, min_time);
+		if(f != stdout)  fclose(f);
+	}
+	return 0;
+}